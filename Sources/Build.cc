@@ -0,0 +1,239 @@
+#include "HexFile.inl"
+#include "HexImage.inl"
+#include "PatchFile.inl"
+#include "Firmware.inl"
+#include "KeyTable.inl"
+#include "KeyDump.inl"
+#include "Keystream.inl"
+#include "Hint.inl"
+#include "Compensate.inl"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <unistd.h>
+
+using namespace std;
+
+// How long each stage of a build took
+class StageTimer
+{
+public:
+	void Stage(const char *name, chrono::steady_clock::time_point start)
+	{
+		stages.push_back({name, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()});
+	}
+
+	void ReportStages(ostream &log) const
+	{
+		double total = 0;
+		for (const auto &[name, milliseconds] : stages)
+		{
+			log << left << setw(8) << name << right << fixed << setprecision(3) << setw(10) << milliseconds << " ms" << endl;
+			total+= milliseconds;
+		}
+		log << left << setw(8) << "total" << right << setw(10) << total << " ms" << endl;
+	}
+
+private:
+	vector<pair<const char *, double>> stages;
+};
+
+static void
+writeFile(const char *path, const string &contents)
+{
+	ofstream os(path, ios_base::binary);
+	if (!os.write(contents.data(), contents.size()) || !os.flush())
+		throw runtime_error("Could not write "s + path);
+}
+
+static string
+readFile(const char *path)
+{
+	ifstream is(path, ios_base::binary);
+	if (!is.is_open())
+		throw runtime_error("Could not open "s + path);
+
+	ostringstream contents;
+	contents << is.rdbuf();
+	return contents.str();
+}
+
+// Does in one process, from one load of the original image, what Patch, Codec, CheckSum and FindKeys do in turn to
+// build a layout: patches the image, fixes its low sum, formats the Intel HEX, verifies its sums, encodes it and dumps
+// its scancode table. Nothing is written unless every check passes.
+int
+main(int ac, char *av[])
+{
+	const char *inputPath = nullptr, *hexPath = nullptr, *codedPath = nullptr, *keysPath = nullptr;
+	const char *referencePath = nullptr, *hintPath = nullptr;
+	string fillerName = "_halts";
+	u_int targetSum = 0;
+	bool haveTargetSum = false, verbose = false;
+
+	ios_base::sync_with_stdio(false);
+
+	int ch;
+	while ((ch = getopt(ac, av, "c:e:f:i:k:o:r:t:v")) != -1)
+		switch (ch)
+		{
+			case 'c':
+				hintPath = optarg;
+				break;
+
+			case 'e':
+				codedPath = optarg;
+				break;
+
+			case 'f':
+				fillerName = optarg;
+				break;
+
+			case 'i':
+				inputPath = optarg;
+				break;
+
+			case 'k':
+				keysPath = optarg;
+				break;
+
+			case 'o':
+				hexPath = optarg;
+				break;
+
+			case 'r':
+				referencePath = optarg;
+				break;
+
+			case 't':
+				targetSum = stoul(optarg, nullptr, 16);
+				haveTargetSum = true;
+				break;
+
+			case 'v':
+				verbose = true;
+				break;
+
+			default:
+				goto usage;
+		}
+
+	ac-= optind;
+	av+= optind - 1;
+
+	if (ac < 1 || !inputPath)
+	{
+usage:
+		cerr << "usage: " << getprogname() << " -i <file.hex> [-o <out.hex>] [-e <out.irrxfw>] [-k <out.keys>] "
+				"[-r <file.irrxfw>] [-c <file.hint> [-f <section>] [-t <sum>]] <file.patch>..." << endl;
+		cerr << "<file.patch>...\tPatches applied in order as layers, as with Patch" << endl;
+		cerr << "-i <file.hex>\tOriginal image, read through its binary sidecar" << endl;
+		cerr << "-o <out.hex>\tWrite the patched image as Intel HEX" << endl;
+		cerr << "-e <out.irrxfw>\tWrite the patched image encoded for the updater" << endl;
+		cerr << "-k <out.keys>\tWrite the scancode table of the patched image as FindKeys does" << endl;
+		cerr << "-r <file.irrxfw>\tFail unless the encoded image is the same as this one" << endl;
+		cerr << "-c <file.hint>\tChange filler bytes the patches leave alone so the image text sum stays the same, as few "
+				"as a search of up to two records finds, otherwise one in each of as many records as it takes" << endl;
+		cerr << "-f <section>\tName of the filler sections in the hint file (default _halts)" << endl;
+		cerr << "-t <sum>\tHex text sum to aim for instead of that of the input image" << endl;
+		cerr << "-v\t\tList the edits of every patch" << endl;
+		return 64; // EX_USAGE
+	}
+
+	StageTimer timer;
+	auto start = chrono::steady_clock::now();
+	HexFile image;
+	HexImage::LoadBlocks(inputPath, image, clog);
+	if (!haveTargetSum)
+		targetSum = SumCompensator::TextSum(image);
+	uint64_t imageHash = Firmware::Hash(image);
+	timer.Stage("load", start);
+
+	start = chrono::steady_clock::now();
+	PatchFile patch = PatchFile::Load(av + 1, ac, verbose, clog);
+	if (patch.GetNumErrors() > 0)
+		return 1;
+
+	if (patch.GetBaseHash() != 0 && patch.GetBaseHash() != imageHash)
+	{
+		cerr << patch.GetPath() << ": error: Compiled for a different image" << endl;
+		return 1;
+	}
+
+	patch.Apply(image);
+	image.UpdateLowSum();
+	if (hintPath)
+	{
+		vector<u_int> fillerAddresses = patch.GetUnwritten(Hint(hintPath).GetExclusiveAddresses(fillerName));
+		SumCompensator::Compensate(image, fillerAddresses, targetSum, clog);
+	}
+	timer.Stage("patch", start);
+
+	start = chrono::steady_clock::now();
+	ostringstream hexText;
+	hexText << image;
+	string text = hexText.str();
+	timer.Stage("format", start);
+
+	// What CheckSum checks that can differ from one build to another; records are well formed as formatRecord made them
+	start = chrono::steady_clock::now();
+	u_int numErrors = 0;
+	u_int plainSum = Simd::SumBytes(reinterpret_cast<const u_char *>(text.data()), text.size());
+	clog << "CheckSum is " << hex << plainSum << endl;
+	if (hintPath && plainSum != targetSum)
+	{
+		cerr << "error: Text sum " << hex << plainSum << " should be " << targetSum << endl;
+		++numErrors;
+	}
+
+	uint16_t lowSum = image.SumLowBlocks();
+	if (image.GetStoredLowSum() != lowSum)
+	{
+		cerr << "error: Stored low sum " << hex << image.GetStoredLowSum() << " should be " << lowSum << endl;
+		++numErrors;
+	}
+	timer.Stage("verify", start);
+
+	start = chrono::steady_clock::now();
+	string coded(text.size(), '\0');
+	Keystream::Apply(reinterpret_cast<u_char *>(coded.data()), reinterpret_cast<const u_char *>(text.data()), text.size());
+	clog << "Encoded CheckSum is " << hex << Simd::SumBytes(reinterpret_cast<const u_char *>(coded.data()), coded.size()) <<
+			endl;
+	if (referencePath && coded != readFile(referencePath))
+	{
+		cerr << "error: Encoded image differs from " << referencePath << endl;
+		++numErrors;
+	}
+	timer.Stage("encode", start);
+
+	start = chrono::steady_clock::now();
+	u_int tableBegin = KeyTable::DefaultBegin, tableEnd = KeyTable::DefaultEnd;
+	if (const Firmware::Entry *firmware = Firmware::Identify(image))
+	{
+		tableBegin = firmware->TableBegin;
+		tableEnd = firmware->TableEnd;
+	}
+
+	ostringstream keys;
+	KeyDump(image, tableBegin, tableEnd).WriteText(keys);
+	timer.Stage("keys", start);
+
+	if (numErrors > 0)
+		return 1;
+
+	start = chrono::steady_clock::now();
+	if (hexPath)
+		writeFile(hexPath, text);
+	if (keysPath)
+		writeFile(keysPath, keys.str());
+	if (codedPath)
+		writeFile(codedPath, coded);
+	timer.Stage("write", start);
+
+	timer.ReportStages(clog);
+	return 0;
+}
@@ -1,35 +1,243 @@
+#include "HexFile.inl"
+#include "HexParser.inl"
+#include "Keystream.inl"
+#include "Loader.inl"
+
+#include <unistd.h>
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
 
 using namespace std;
 
-static const bool verbose = false;
+static bool verbose = false;
 
-int
-main(void)
+// Verifies every checksum involved in flashing an image in one pass over either the .irrxfw or the decoded Intel HEX:
+// the byte sums of both forms of the file, the check byte of every record, the 16-bit sum of 0x80 - 0x1300 against
+// the value stored at 0x1ffe/0x1fff, and the blocks that Upload turns into loader messages.
+class Verifier
 {
-	u_int checkSum = 0;
+public:
+	// Each line is parsed on its own, so that a bad record is reported and the rest are still checked
+	void AddLine(const u_char *line, size_t length)
+	{
+		++lineNum;
 
-	ios_base::sync_with_stdio(false);
+		HexParser parser(line, line + length);
+		HexParser::Record record;
+		try
+		{
+			while (parser.Next(record))
+				addRecord(record);
+		}
+		catch (const runtime_error &exception)
+		{
+			error(exception.what());
+		}
+	}
 
-	freopen(NULL, "rb", stdin);
-	u_char ch;
+	int Report(u_int plainSum, u_int codedSum, bool coded)
+	{
+		if (!endSeen)
+			error("Expected end record before EOF");
+
+		clog << hex;
+		clog << "CheckSum is " << plainSum;
+		if (plainSum != Keystream::ExpectedPlainSum)
+			mismatch("decoded image sum", plainSum, Keystream::ExpectedPlainSum);
+		clog << endl;
+
+		// Filler bytes changed to keep the decoded sum also change the encoded one, so it is only shown
+		if (coded)
+			clog << "Encoded CheckSum is " << codedSum << endl;
+
+		clog << "Low blocks from " << HexFile::BeginSummed << " to " << HexFile::EndSummed << " have sum " << lowSum;
+		if (storedSumBytes != 2)
+			errors.push_back("No stored low sum at " + hexString(HexFile::StoredSumAddress));
+		else
+		{
+			clog << ", stored sum is " << storedSum;
+			if (storedSum != lowSum)
+				mismatch("stored low sum", storedSum, lowSum);
+		}
+		clog << endl;
+
+		clog << "Loader messages for " << dec << numBlocks << " blocks" << endl;
+
+		for (const string &message : errors)
+			cerr << "error: " << message << endl;
+
+		return errors.empty() ? 0 : 1;
+	}
+
+private:
+	void addRecord(const HexParser::Record &record)
+	{
+		if (endSeen && !trailingReported)
+		{
+			error("Additional records after end record");
+			trailingReported = true;
+		}
+
+		switch (record.Type)
+		{
+			case 0:
+				addData(record.Address, record.Data, record.Length);
+				break;
+
+			case 1:
+				endSeen = true;
+				break;
+
+			case 4:
+				if (record.Length != 2)
+					return error("Invalid segment record length " + to_string(record.Length));
+				segment = record.Data[0] << 8 | record.Data[1];
+				break;
+
+			default:
+				error("Unknown record type " + to_string(record.Type));
+		}
+	}
+
+	static string hexString(u_int value)
+	{
+		ostringstream oss;
+		oss << "0x" << hex << value;
+		return oss.str();
+	}
+
+	void error(const string &message)
+	{
+		errors.push_back("line " + to_string(lineNum) + ": " + message);
+	}
 
-	cin >> noskipws;
+	void mismatch(const string &what, u_int actual, u_int expected)
+	{
+		clog << " (discrepancy " << dec << (int)(actual - expected) << hex << ')';
+		errors.push_back(what + ' ' + hexString(actual) + " should be " + hexString(expected));
+	}
 
-	while (cin >> ch)
+	void addData(u_int address, const u_char *data, u_int length)
 	{
-		checkSum+= ch;
+		if (segment > 0)
+			return;
+
+		for (u_int offset = 0; offset < length; ++offset)
+		{
+			u_int byteAddress = address + offset;
+			if (byteAddress >= HexFile::BeginSummed && byteAddress < HexFile::EndSummed)
+				lowSum+= data[offset];
+			else if (byteAddress == HexFile::StoredSumAddress || byteAddress == HexFile::StoredSumAddress + 1u)
+			{
+				storedSum|= data[offset] << ((byteAddress == HexFile::StoredSumAddress) ? 8 : 0);
+				++storedSumBytes;
+			}
+		}
+
+		// The same checks that Upload applies before sending a block
+		if (length != 64)
+			return error("Record length " + to_string(length) + " is not a 64-byte flash block");
+		if (address & 63)
+			return error("Record address " + hexString(address) + " not 64-byte aligned");
+		if (address > 64 * 0xff)
+			return error("Record address " + hexString(address) + " too high");
+
+		uint8_t blockNum = address / 64;
+		LoaderMessage firstHalf(LoaderCommand::Write, blockNum, 0, data, 32);
+		LoaderMessage secondHalf(LoaderCommand::Write, blockNum, 1, data + 32, 32);
+		++numBlocks;
+
 		if (verbose)
-			clog << "ch(" << ch << "), checkSum " << hex << checkSum << endl;
+			clog << "Block " << dec << setw(3) << (u_int)blockNum << " at " << hexString(address)
+					<< ": loader checksums " << hexString(firstHalf.GetCheckSum()) << ' '
+					<< hexString(secondHalf.GetCheckSum()) << endl;
 	}
 
-	int status = 0;
-	clog << "CheckSum is " << hex << checkSum;
-	if (checkSum != 0x1057f8)
+	u_int lineNum = 0;
+	uint16_t segment = 0;
+	bool endSeen = false, trailingReported = false;
+	uint16_t lowSum = 0, storedSum = 0;
+	u_int storedSumBytes = 0;
+	u_int numBlocks = 0;
+	vector<string> errors;
+};
+
+int
+main(int ac, char *av[])
+{
+	int ch;
+	while ((ch = getopt(ac, av, "v")) != -1)
+		switch (ch)
+		{
+			case 'v':
+				verbose = true;
+				break;
+
+			default:
+				cerr << "usage: " << av[0] << " [-v] < { <file.irrxfw> | <file.hex> }" << endl;
+				cerr << "-v\t\tList the loader message checksums of every block" << endl;
+				return 64; // EX_USAGE
+		}
+
+	ios_base::sync_with_stdio(false);
+
+	freopen(NULL, "rb", stdin);
+
+	// Accept either the decoded Intel HEX or the encoded .irrxfw image
+	bool coded = (cin.peek() != EOF && Keystream::IsCoded(cin.peek()));
+
+	Verifier verifier;
+	vector<u_char> buffer(Keystream::Period * 16);
+	string line;
+	size_t position = 0;
+	u_int plainSum = 0, codedSum = 0;
+
+	while (cin)
 	{
-		clog << " (discrepancy " << dec << (int)(checkSum - 0x1057f8) << ')';
-		status = 1;
+		cin.read(reinterpret_cast<char *>(buffer.data()), buffer.size());
+		size_t length = cin.gcount();
+		if (length == 0)
+			break;
+
+		if (coded)
+		{
+			codedSum+= Simd::SumBytes(buffer.data(), length);
+			Keystream::Apply(buffer.data(), buffer.data(), length, position);
+		}
+		plainSum+= Simd::SumBytes(buffer.data(), length);
+		position+= length;
+
+		const u_char *begin = buffer.data(), *end = buffer.data() + length;
+		while (begin < end)
+		{
+			const u_char *newline = find(begin, end, '\n');
+			if (newline == end)
+			{
+				line.append(begin, end);
+				break;
+			}
+
+			if (line.empty())
+				verifier.AddLine(begin, newline - begin);
+			else
+			{
+				line.append(begin, newline);
+				verifier.AddLine(reinterpret_cast<const u_char *>(line.data()), line.size());
+				line.clear();
+			}
+			begin = newline + 1;
+		}
 	}
-	clog << endl;
-	return status;
+
+	if (!line.empty())
+		verifier.AddLine(reinterpret_cast<const u_char *>(line.data()), line.size());
+
+	if (!cin.eof())
+		throw runtime_error("Read error at offset " + to_string(position));
+
+	return verifier.Report(plainSum, codedSum, coded);
 }
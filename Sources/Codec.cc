@@ -1,86 +1,174 @@
+#include "Keystream.inl"
+
 #include <sys/types.h>
+#include <unistd.h>
 #include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <random>
 
 using namespace std;
 
 static const bool verbose = false;
 
-int
-main(void)
+static double
+megabytesPerSecond(size_t length, chrono::steady_clock::duration elapsed)
 {
-	static const u_char a[] =
+	return (length / 1048576.0) / chrono::duration<double>(elapsed).count();
+}
+
+template <typename F>
+static chrono::steady_clock::duration
+timeIt(F &&func)
+{
+	auto start = chrono::steady_clock::now();
+	func();
+	return chrono::steady_clock::now() - start;
+}
+
+static int
+benchmark(size_t megabytes)
+{
+	const size_t length = megabytes << 20;
+	vector<u_char> input(length), reference(length), scalar(length), simd(length);
+
+	mt19937 random(0x1057f8);
+	for (auto &ch : input)
+		ch = random();
+
+	auto referenceTime = timeIt([&]
 	{
-		0x31, 0x1c, 0xef, 0x62, 0xdf, 0xa7, 0x43, 0x23, 0x78, 0x92, 0x22, 0x6a,
-		0x38, 0x12, 0x14, 0xa4, 0x65, 0x02, 0x2b, 0x00, 0x9c, 0x00, 0x57, 0x5e,
-		0x10, 0x85, 0x50, 0x73, 0xd0, 0xb1, 0x17, 0x2b, 0x49, 0xac, 0x49, 0xc4,
-		0x33, 0x21, 0xb4, 0x48, 0x23, 0x8c, 0x27, 0x98, 0x12, 0x34, 0x80, 0x00,
-		0x48, 0xff, 0xb4, 0x8f, 0x04, 0x2e, 0x24, 0x2d, 0x92, 0xc7, 0x82, 0xe2,
-		0xa6, 0xa5, 0x20, 0x20, 0x98, 0x11, 0x84, 0x26, 0xb7, 0xcc, 0x28, 0xf3,
-		0xe6, 0x98, 0x38, 0x23, 0xdc, 0xba, 0x28, 0x44, 0x42, 0x39, 0x44,
-	}, b[] =
+		for (size_t position = 0; position < length; ++position)
+			reference[position] = input[position] ^ Keystream::ReferenceKey(position);
+	});
+	auto scalarTime = timeIt([&] { Keystream::Apply(scalar.data(), input.data(), length, 0, false); });
+	auto simdTime = timeIt([&] { Keystream::Apply(simd.data(), input.data(), length); });
+
+	clog << "Coded " << megabytes << " MB:" << endl;
+	clog << left;
+	clog << "  " << setw(20) << "per-byte reference:" << megabytesPerSecond(length, referenceTime) << " MB/s" << endl;
+	clog << "  " << setw(20) << "scalar table:" << megabytesPerSecond(length, scalarTime) << " MB/s" << endl;
+	clog << "  " << setw(20) << (Simd::Name + " table:"s) << megabytesPerSecond(length, simdTime) << " MB/s" << endl;
+
+	if (scalar != reference || simd != reference)
 	{
-		0x12, 0x14, 0xa4, 0x65, 0x02, 0x2b, 0x00, 0x9c, 0x00, 0x57, 0x5e, 0x10,
-		0x85, 0x50, 0x73, 0xd0, 0xb1, 0x17, 0x2b, 0x49, 0xac, 0x49, 0xc4, 0x33,
-		0x21, 0xb4, 0x48, 0x23, 0x8c, 0x27, 0x98, 0x12, 0x34, 0x80, 0x00, 0x48,
-		0xff, 0xb4, 0x8f, 0x04, 0x2e, 0x24, 0x2d, 0x92, 0xc7, 0x82, 0xe2, 0xa6,
-		0xa5, 0x20, 0x20, 0x98, 0x11,
-	};
-
-	u_int inputPos = 0;
-	u_int checkSum = 0;
-	u_int stack_148 = 0x11;
+		cerr << "Output does not match the per-byte reference" << endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int ac, char *av[])
+{
+	bool useSimd = true;
+	size_t benchMegabytes = 0;
+	size_t offset = 0, length = SIZE_MAX;
+	unsigned numThreads = 1;
+
+	int ch;
+	while ((ch = getopt(ac, av, "b:j:n:o:s")) != -1)
+		switch (ch)
+		{
+			case 'b':
+				benchMegabytes = stoul(optarg);
+				break;
+
+			case 'j':
+				numThreads = stoul(optarg);
+				break;
+
+			case 'n':
+				length = stoul(optarg, nullptr, 0);
+				break;
+
+			case 'o':
+				offset = stoul(optarg, nullptr, 0);
+				break;
+
+			case 's':
+				useSimd = false;
+				break;
+
+			default:
+				cerr << "usage: " << av[0] << " [-s] [-j <threads>] [-o <offset>] [-n <length>] < <input> > <output>" << endl;
+				cerr << "       " << av[0] << " [-s] -b <megabytes>" << endl;
+				cerr << "-s\t\tUse the scalar code path" << endl;
+				cerr << "-j <threads>\tCode the input in chunks on a pool of threads (0 for one per CPU)" << endl;
+				cerr << "-o <offset>\tOnly code the input starting at this byte offset within the image" << endl;
+				cerr << "-n <length>\tOnly code this many bytes of the input" << endl;
+				cerr << "-b <megabytes>\tBenchmark coding throughput on a synthetic buffer and exit" << endl;
+				return 64; // EX_USAGE
+		}
+
+	if (benchMegabytes > 0)
+		return benchmark(benchMegabytes);
 
 	ios_base::sync_with_stdio(false);
 
 	freopen(NULL, "rb", stdin);
-	while (cin)
+
+	if (offset > 0 && (!cin.ignore(offset) || (size_t)cin.gcount() != offset))
+		throw runtime_error("Input ends before offset " + to_string(offset));
+
+	size_t inputPos = offset;
+	u_int checkSum = 0;
+
+	if (numThreads != 1)
+	{
+		// The keystream only depends on the position, so the whole range is read and then coded in parallel chunks
+		vector<u_char> buffer;
+		static const size_t readSize = 1 << 20;
+		while (cin && buffer.size() < length)
+		{
+			size_t oldSize = buffer.size();
+			buffer.resize(oldSize + min(readSize, length - oldSize));
+			cin.read(reinterpret_cast<char *>(buffer.data() + oldSize), buffer.size() - oldSize);
+			buffer.resize(oldSize + cin.gcount());
+		}
+
+		ThreadPool pool(numThreads);
+		Keystream::Apply(pool, buffer.data(), buffer.data(), buffer.size(), inputPos, useSimd);
+		checkSum = Simd::SumBytes(buffer.data(), buffer.size());
+
+		if (verbose)
+			clog << hex << inputPos << ": coded " << dec << buffer.size() << " bytes on " << pool.GetNumThreads() << " threads" << endl;
+
+		cout.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+		inputPos+= buffer.size();
+	}
+	else
 	{
-		int edx = 0x3521cfb3;
-		int eax = stack_148;
-		u_int64_t result = (u_int64_t)eax * (u_int)edx;
-		eax = result & 0xffffffff;
-		edx = result >> 32;
-		eax = stack_148;
-		eax-= edx;
-		eax>>= 1;
-		edx+= eax;
-		eax = stack_148;
-		edx>>= 5;
-		edx*= 0x35;
-		eax-= edx;
-
-		assert(eax < 0x35);
-		u_char bCh = b[eax];
-
-		for (u_int aOffset = 0; aOffset < size(a); ++aOffset)
+		static const size_t bufferSize = Keystream::Period * 16;
+		vector<u_char> buffer(bufferSize);
+		size_t remaining = length;
+
+		while (cin && remaining > 0)
 		{
-			u_char inCh;
-			if (!cin.read((char *)&inCh, sizeof(inCh)))
+			cin.read(reinterpret_cast<char *>(buffer.data()), min(buffer.size(), remaining));
+			size_t readLength = cin.gcount();
+			if (readLength == 0)
 				break;
 
-			u_char aCh = ~a[aOffset];
-			u_char outCh = (aCh ^ bCh) ^ inCh;
-			checkSum+= outCh;
+			Keystream::Apply(buffer.data(), buffer.data(), readLength, inputPos, useSimd);
+			checkSum+= Simd::SumBytes(buffer.data(), readLength);
+
 			if (verbose)
-				clog << hex
-						<< inputPos << ": "
-						<< "~a[" << aOffset << "](=" << (u_int)aCh << ") ^ "
-						<< "b[" << eax << "](=" << (u_int)bCh << ") ^ "
-						<< (u_int)inCh << " = "
-						<< (u_int)outCh << '(' << (u_char)(isprint(outCh) ? outCh : '?') << ')'
-						<< endl;
-			++inputPos;
-			cout << outCh;
-		}
+				clog << hex << inputPos << ": coded " << dec << readLength << " bytes" << endl;
 
-		++stack_148;
+			cout.write(reinterpret_cast<const char *>(buffer.data()), readLength);
+			inputPos+= readLength;
+			remaining-= readLength;
+		}
 	}
 
-	if (!cin.eof())
+	if (cin.bad() || (!cin.eof() && length == SIZE_MAX))
 		throw runtime_error("Read error at offset " + to_string(inputPos));
 
 	clog << "Checksum is " << hex << checkSum << endl;
 
-	//return (checkSum == 0x1057f8 || checkSum == 0x252ed7) ? 0 : 1;
+	//return (checkSum == Keystream::ExpectedPlainSum || checkSum == Keystream::ExpectedCodedSum) ? 0 : 1;
 	return 0;
 }
@@ -0,0 +1,689 @@
+#pragma once
+
+#include "HexFile.inl"
+
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstdlib>
+#include <iomanip>
+#include <ostream>
+
+// Apple's updater checks the byte sum of the decoded Intel HEX text as well as the 16-bit sum of 0x80 - 0x1300 that
+// is stored at 0x1ffe/0x1fff. Changing one data byte changes the text sum through its two hex digits, through the check
+// byte of its record, and, inside the summed range, through the stored low sum and the check byte of the record that
+// holds it. SumCompensator picks filler bytes to change so that both sums come out right, evaluating each candidate
+// change from those few deltas instead of rescanning the image.
+class SumCompensator
+{
+public:
+	struct Change
+	{
+		u_int Address;
+		u_char OldValue, NewValue;
+	};
+
+	// Text sum of a byte as written by operator<<(std::ostream &, const HexFile::Record &), i.e. two lower case digits
+	static int HexTextSum(u_char byte)
+	{
+		auto digit = [](u_char nybble) { return (nybble < 10) ? '0' + nybble : 'a' + nybble - 10; };
+		return digit(byte >> 4) + digit(byte & 0xf);
+	}
+
+	static u_int TextSum(const HexFile &image)
+	{
+		u_int sum = 0;
+		for (const HexFile::Record &record : image.records)
+		{
+			u_char checkSum = 0;
+			auto addByte = [&](u_char byte)
+			{
+				sum+= HexTextSum(byte);
+				checkSum-= byte;
+			};
+
+			sum+= ':' + '\r' + '\n';
+			addByte(record.length);
+			addByte(record.address >> 8);
+			addByte(record.address);
+			addByte(record.type);
+			if (record.type == 0)
+				for (u_char byte : record)
+					addByte(byte);
+			else
+				for (u_int index = 0; index < record.ValueLength(); ++index)
+					addByte(record.value >> ((record.ValueLength() - 1 - index) * 8));
+			sum+= HexTextSum(checkSum);
+		}
+		return sum;
+	}
+
+	SumCompensator(HexFile &image, const std::vector<u_int> &fillerAddresses) : image(image)
+	{
+		storedRecord = findRecord(HexFile::StoredSumAddress);
+		if (storedRecord == NoRecord || findRecord(HexFile::StoredSumAddress + 1) != storedRecord)
+			throw std::runtime_error("Stored low sum must be in a single record");
+
+		for (u_int address : fillerAddresses)
+		{
+			size_t record = findRecord(address);
+			if (record == NoRecord || record == storedRecord)
+				continue;
+
+			u_char oldValue = image[address];
+			bool summed = (address >= HexFile::BeginSummed && address < HexFile::EndSummed);
+			auto fillerClass = std::find_if(classes.begin(), classes.end(), [&](const FillerClass &existing)
+			{
+				return existing.Record == record && existing.OldValue == oldValue && existing.Summed == summed;
+			});
+			if (fillerClass == classes.end())
+				fillerClass = classes.insert(classes.end(), {record, oldValue, summed, {}});
+			fillerClass->Addresses.push_back(address);
+		}
+	}
+
+	// Solves for targetSum and lists the changes made on log
+	static std::vector<Change> Compensate(HexFile &image, const std::vector<u_int> &fillerAddresses, u_int targetSum,
+			std::ostream &log)
+	{
+		std::vector<Change> changes = SumCompensator(image, fillerAddresses).Solve(targetSum);
+
+		log << "Text sum " << std::hex << targetSum << " needed " << std::dec << changes.size() << " filler byte changes" <<
+				std::endl;
+		for (const Change &change : changes)
+			log << std::hex << std::setw(4) << std::setfill('0') << change.Address << ": " << std::setw(2) <<
+					(u_int)change.OldValue << " -> " << std::setw(2) << (u_int)change.NewValue << std::endl;
+		return changes;
+	}
+
+
+	// Find as few filler changes as possible that make the image's text sum equal targetSum once the stored low sum
+	// has been updated. Every solution of up to three changes in each of up to two records is searched, fewest changes
+	// first, from tables of what each record can do. Failing that, one change in each of as many records as it takes is
+	// found by going through them in turn; only a discrepancy too large for those is first reduced greedily, one change
+	// at a time. The text sum is computed once and then kept up to date from the effect of each change.
+	std::vector<Change> Solve(u_int targetSum)
+	{
+		image.UpdateLowSum();
+		loadSums();
+		int discrepancy = targetSum - TextSum(image);
+		std::vector<Change> changes;
+
+		while (discrepancy != 0)
+		{
+			// Discrepancies beyond what a few changes can make up are reduced greedily first
+			std::vector<Move> moves;
+			bool found = std::abs(discrepancy) > MaxLocal + MaxStored && bestSingle(discrepancy, moves);
+			if (!found)
+			{
+				loadTables();
+				found = search(discrepancy, moves) || searchSpread(discrepancy, moves) ||
+						bestSingle(discrepancy, moves);
+			}
+			if (!found)
+				throw std::runtime_error("Could not find filler bytes to compensate a text sum discrepancy of " +
+						std::to_string(discrepancy));
+
+			// Applied one after the other, the effects of moves add up to the effect they were chosen for
+			for (const Move &move : moves)
+			{
+				discrepancy-= localEffect(move) + storedEffect(lowDelta(move));
+				changes.push_back(apply(move));
+			}
+		}
+		return changes;
+	}
+
+private:
+	static constexpr size_t NoRecord = SIZE_MAX;
+
+	// Most changes searched in one record, and bounds of the byte delta of a change, of the text sum change of its two
+	// digits, of that of the stored low sum and of that of a record, check byte included, with the most changes
+	static constexpr int MaxChanges = 3, MaxDelta = 0xff, MaxDigits = ('f' + 'f') - ('0' + '0');
+	static constexpr int MaxStored = 3 * MaxDigits, MaxLocal = (MaxChanges + 1) * MaxDigits;
+	static constexpr size_t MaxCombined = 8;
+
+	// Bound of the low sum delta and of the effect on the text sum kept track of when spreading changes over records
+	static constexpr int MaxSpread = 4 * MaxDelta;
+
+	// Has bit effect + MaxLocal set for every effect on the text sum that something can have
+	using EffectSet = std::bitset<2 * MaxLocal + 1>;
+
+	// For every low sum delta low, row low + MaxSpread has bit effect + MaxSpread set for every effect some changes
+	// with that low sum delta can have on the text sum of their records
+	using SpreadSet = std::bitset<2 * MaxSpread + 1>;
+	using SpreadTable = std::vector<SpreadSet>;
+
+	struct FillerClass
+	{
+		size_t Record;
+		u_char OldValue;
+		bool Summed;
+		std::vector<u_int> Addresses;
+	};
+
+	struct Move
+	{
+		size_t Class;
+		u_char NewValue;
+	};
+
+	// A change of a group by Delta in total that changes the text sum of its digits by Digits
+	struct GroupChange
+	{
+		int Delta, Digits;
+	};
+
+	// The available classes of a record that count the same towards the low sum, with OldValues sorted.
+	// Digits[count - 1][delta + count * MaxDelta] has the effects on the text sum of their digits when up to count of
+	// their bytes change by delta in total; beyond one change those include changing a byte twice.
+	struct FillerGroup
+	{
+		size_t Record;
+		bool Summed;
+		std::vector<size_t> Classes;
+		std::vector<u_char> OldValues;
+		std::array<std::vector<EffectSet>, MaxChanges> Digits;
+	};
+
+	size_t findRecord(u_int address) const
+	{
+		for (size_t index = 0; index < image.records.size(); ++index)
+		{
+			const HexFile::Record &record = image.records[index];
+			if (record.type == 0 && record.LinearAddress() <= address && record.LinearAddress() + record.length > address)
+				return index;
+		}
+		return NoRecord;
+	}
+
+	u_char recordCheckByte(size_t index) const
+	{
+		const HexFile::Record &record = image.records[index];
+		u_char checkSum = -(record.length + (record.address >> 8) + record.address + record.type);
+		for (u_char byte : record)
+			checkSum-= byte;
+		return checkSum;
+	}
+
+	void loadSums()
+	{
+		storedSum = image.GetStoredLowSum();
+		storedCheck = recordCheckByte(storedRecord);
+		checkBytes.clear();
+		for (const FillerClass &fillerClass : classes)
+			checkBytes.push_back(recordCheckByte(fillerClass.Record));
+	}
+
+	// Groups the available classes; their changes are tabulated by tabulate() as a search needs them
+	void loadTables()
+	{
+		groups.clear();
+		for (size_t fillerClass = 0; fillerClass < classes.size(); ++fillerClass)
+		{
+			if (!available(fillerClass))
+				continue;
+
+			const FillerClass &current = classes[fillerClass];
+			auto group = std::find_if(groups.begin(), groups.end(), [&](const FillerGroup &existing)
+			{
+				return existing.Record == current.Record && existing.Summed == current.Summed;
+			});
+			if (group == groups.end())
+				group = groups.insert(groups.end(), {current.Record, current.Summed, {}, {}, {}});
+			group->Classes.push_back(fillerClass);
+			std::vector<u_char> &oldValues = group->OldValues;
+			oldValues.insert(std::upper_bound(oldValues.begin(), oldValues.end(), current.OldValue), current.OldValue);
+		}
+		tabulated = 0;
+	}
+
+	// Text sums of the digits of count bytes, by their byte sum: bit sum of curves()[count - 1][bytes]
+	static const std::array<std::vector<EffectSet>, MaxChanges> &curves()
+	{
+		static const std::array<std::vector<EffectSet>, MaxChanges> curves = []
+		{
+			std::array<std::vector<EffectSet>, MaxChanges> table;
+			for (int count = 1; count <= MaxChanges; ++count)
+			{
+				table[count - 1].resize(count * 0xff + 1);
+				for (u_int byte = 0; byte < 0x100; ++byte)
+					if (count == 1)
+						table[0][byte].set(HexTextSum(byte));
+					else
+						for (size_t bytes = 0; bytes < table[count - 2].size(); ++bytes)
+							table[count - 1][bytes + byte]|= table[count - 2][bytes] << HexTextSum(byte);
+			}
+			return table;
+		}();
+		return curves;
+	}
+
+	// Fills in Digits up to count changes, and locals[count - 1][low + count * MaxDelta] with the effects on the text
+	// sum of their record that up to count changes in one record can have when they change the low sum by low, which
+	// range from lowest[count - 1] to highest[count - 1]
+	void tabulate(int count)
+	{
+		for (; tabulated < count; ++tabulated)
+		{
+			int changes = tabulated + 1, rows = 2 * changes * MaxDelta + 1;
+			locals[tabulated].assign(rows, EffectSet());
+			for (FillerGroup &group : groups)
+			{
+				std::vector<EffectSet> &digits = group.Digits[tabulated];
+				auto same = std::find_if(groups.begin(), groups.end(), [&](const FillerGroup &existing)
+				{
+					return existing.OldValues == group.OldValues;
+				});
+				if (&*same != &group)
+					digits = same->Digits[tabulated];
+				else
+				{
+					// Whichever bytes change, the new ones are on the curve, offset by the sums of the old ones
+					// Beyond one change only some old values spread over the range are combined, which fill the
+					// tables about as well as all of them would, many different ones as records of random filler have
+					size_t step = (changes == 1) ? 1 : (group.OldValues.size() + MaxCombined - 1) / MaxCombined;
+					std::vector<std::pair<int, int>> olds{{0, 0}};
+					for (int change = 0; change < changes; ++change)
+					{
+						std::vector<std::pair<int, int>> more;
+						for (const std::pair<int, int> &old : olds)
+							for (size_t index = 0; index < group.OldValues.size(); index+= step)
+								more.push_back({old.first + group.OldValues[index],
+										old.second + HexTextSum(group.OldValues[index])});
+						std::sort(more.begin(), more.end());
+						more.erase(std::unique(more.begin(), more.end()), more.end());
+						olds.swap(more);
+					}
+
+					const std::vector<EffectSet> &curve = curves()[tabulated];
+					digits.assign(rows, EffectSet());
+					for (const std::pair<int, int> &old : olds)
+						for (size_t bytes = 0; bytes < curve.size(); ++bytes)
+						{
+							EffectSet &row = digits[bytes - old.first + changes * MaxDelta];
+							row|= shifted(curve[bytes], MaxLocal - old.second);
+						}
+				}
+
+				u_char checkByte = checkBytes[group.Classes.front()];
+				for (int delta = -changes * MaxDelta; delta <= changes * MaxDelta; ++delta)
+					locals[tabulated][(group.Summed ? delta : 0) + changes * MaxDelta]|=
+							shifted(digits[delta + changes * MaxDelta], checkEffect(checkByte, delta));
+			}
+
+			// Bit n of a reversed row, shifted by total, is set when the row has total - n
+			reversedLocals[tabulated].assign(rows, EffectSet());
+			lowest[tabulated] = highest[tabulated] = 0;
+			for (int row = 0; row < rows; ++row)
+				for (int bit = 0; locals[tabulated][row].any() && bit < (int)EffectSet().size(); ++bit)
+					if (locals[tabulated][row][bit])
+					{
+						reversedLocals[tabulated][row].set(EffectSet().size() - 1 - bit);
+						lowest[tabulated] = std::min(lowest[tabulated], bit - MaxLocal);
+						highest[tabulated] = std::max(highest[tabulated], bit - MaxLocal);
+					}
+		}
+	}
+
+	// Makes a move on the image and updates the check bytes and stored low sum to match, as loadSums() would
+	Change apply(const Move &move)
+	{
+		FillerClass &fillerClass = classes[move.Class];
+		int delta = byteDelta(move);
+		for (size_t index = 0; index < classes.size(); ++index)
+			if (classes[index].Record == fillerClass.Record)
+				checkBytes[index]-= delta;
+
+		uint16_t newSum = storedSum + lowDelta(move);
+		u_char oldHigh = storedSum >> 8, oldLow = storedSum, newHigh = newSum >> 8, newLow = newSum;
+		storedCheck-= (newHigh - oldHigh) + (newLow - oldLow);
+		storedSum = newSum;
+
+		u_int address = fillerClass.Addresses.back();
+		fillerClass.Addresses.pop_back();
+		image[address] = move.NewValue;
+		image.UpdateLowSum();
+		return {address, fillerClass.OldValue, move.NewValue};
+	}
+
+	// Text sum change of a record whose data bytes change by byteDelta in total
+	static int checkEffect(u_char checkByte, int byteDelta)
+	{
+		return HexTextSum(checkByte - byteDelta) - HexTextSum(checkByte);
+	}
+
+	// Text sum change from rewriting the stored low sum after the summed bytes change by lowDelta
+	int storedEffect(int lowDelta) const
+	{
+		uint16_t newSum = storedSum + lowDelta;
+		u_char oldHigh = storedSum >> 8, oldLow = storedSum, newHigh = newSum >> 8, newLow = newSum;
+		return HexTextSum(newHigh) - HexTextSum(oldHigh) + HexTextSum(newLow) - HexTextSum(oldLow) +
+				checkEffect(storedCheck, (newHigh - oldHigh) + (newLow - oldLow));
+	}
+
+	int byteDelta(const Move &move) const { return move.NewValue - classes[move.Class].OldValue; }
+	int lowDelta(const Move &move) const { return classes[move.Class].Summed ? byteDelta(move) : 0; }
+
+	int digitsEffect(const Move &move) const
+	{
+		return HexTextSum(move.NewValue) - HexTextSum(classes[move.Class].OldValue);
+	}
+
+	// Effect of a move on its own record, excluding the stored low sum
+	int localEffect(const Move &move) const
+	{
+		return digitsEffect(move) + checkEffect(checkBytes[move.Class], byteDelta(move));
+	}
+
+	bool available(size_t fillerClass, size_t count = 1) const
+	{
+		return classes[fillerClass].Addresses.size() >= count;
+	}
+
+	static size_t uses(const std::vector<Move> &moves, size_t fillerClass)
+	{
+		return std::count_if(moves.begin(), moves.end(), [&](const Move &move) { return move.Class == fillerClass; });
+	}
+
+	static bool test(const EffectSet &set, int effect)
+	{
+		return std::abs(effect) <= MaxLocal && set[effect + MaxLocal];
+	}
+
+	template <typename Set>
+	static Set shifted(const Set &set, int shift)
+	{
+		return (shift >= 0) ? set << shift : set >> -shift;
+	}
+
+	// Adds up to count moves of group, of addresses not already moved, that change its bytes by delta in total and the
+	// text sum of their digits by digits. The tables only narrow the search down, as they allow a byte to change twice.
+	bool addMoves(std::vector<Move> &moves, const FillerGroup &group, int count, int delta, int digits) const
+	{
+		if (delta == 0 && digits == 0)
+			return true;
+
+		for (size_t fillerClass : group.Classes)
+		{
+			if (count == 0 || !available(fillerClass, uses(moves, fillerClass) + 1))
+				continue;
+
+			for (u_int newValue = 0; newValue < 0x100; ++newValue)
+			{
+				Move move{fillerClass, (u_char)newValue};
+				int restDelta = delta - byteDelta(move), restDigits = digits - digitsEffect(move);
+				if (byteDelta(move) == 0 || (count > 1 && (std::abs(restDelta) > (count - 1) * MaxDelta ||
+						!test(group.Digits[count - 2][restDelta + (count - 1) * MaxDelta], restDigits))))
+					continue;
+
+				moves.push_back(move);
+				if (addMoves(moves, group, count - 1, restDelta, restDigits))
+					return true;
+				moves.pop_back();
+			}
+		}
+		return false;
+	}
+
+	// Adds count moves of group whose low sum delta is low and whose effect on their record is local
+	bool addLocal(std::vector<Move> &moves, const FillerGroup &group, int count, int low, int local) const
+	{
+		u_char checkByte = checkBytes[group.Classes.front()];
+		int first = group.Summed ? low : -count * MaxDelta, last = group.Summed ? low : count * MaxDelta;
+		for (int delta = first; delta <= last; ++delta)
+		{
+			int digits = local - checkEffect(checkByte, delta);
+			if (test(group.Digits[count - 1][delta + count * MaxDelta], digits) &&
+					addMoves(moves, group, count, delta, digits))
+				return true;
+		}
+		return false;
+	}
+
+	// Solutions with as few changes as possible, in one record or two, skipping those the tables show to fall short
+	bool search(int discrepancy, std::vector<Move> &moves)
+	{
+		int lowestStored = 0, highestStored = 0;
+		for (int low = -2 * MaxChanges * MaxDelta; low <= 2 * MaxChanges * MaxDelta; ++low)
+		{
+			lowestStored = std::min(lowestStored, storedEffect(low));
+			highestStored = std::max(highestStored, storedEffect(low));
+		}
+		auto reaches = [&](int lowestLocal, int highestLocal)
+		{
+			return discrepancy >= lowestLocal + lowestStored && discrepancy <= highestLocal + highestStored;
+		};
+
+		for (int count = 1; count <= 2 * MaxChanges; ++count)
+		{
+			for (int count1 = std::min(count - 1, MaxChanges); 2 * count1 >= count; --count1)
+			{
+				int count2 = count - count1;
+				tabulate(count1);
+				if (reaches(lowest[count1 - 1] + lowest[count2 - 1], highest[count1 - 1] + highest[count2 - 1]) &&
+						searchTwo(discrepancy, count1, count2, moves))
+					return true;
+			}
+			if (count <= MaxChanges)
+			{
+				tabulate(count);
+				if (reaches(lowest[count - 1], highest[count - 1]) && searchOne(discrepancy, count, moves))
+					return true;
+			}
+		}
+		return false;
+	}
+
+	bool searchOne(int discrepancy, int count, std::vector<Move> &moves) const
+	{
+		for (const FillerGroup &group : groups)
+		{
+			u_char checkByte = checkBytes[group.Classes.front()];
+			for (int delta = -count * MaxDelta; delta <= count * MaxDelta; ++delta)
+			{
+				int digits = discrepancy - checkEffect(checkByte, delta) - storedEffect(group.Summed ? delta : 0);
+				if (test(group.Digits[count - 1][delta + count * MaxDelta], digits) &&
+						addMoves(moves, group, count, delta, digits))
+					return true;
+			}
+		}
+		return false;
+	}
+
+	// Records only interact through the stored low sum, so for every pair of low sum deltas match the local effects
+	// of one against those the other needs to make up the rest of the discrepancy
+	bool searchTwo(int discrepancy, int count1, int count2, std::vector<Move> &moves) const
+	{
+		const std::vector<EffectSet> &locals1 = locals[count1 - 1], &reversed2 = reversedLocals[count2 - 1];
+		for (int low1 = -count1 * MaxDelta; low1 <= count1 * MaxDelta; ++low1)
+		{
+			const EffectSet &row1 = locals1[low1 + count1 * MaxDelta];
+			if (row1.none())
+				continue;
+
+			for (int low2 = -count2 * MaxDelta; low2 <= count2 * MaxDelta; ++low2)
+			{
+				const EffectSet &row2 = reversed2[low2 + count2 * MaxDelta];
+				int total = discrepancy - storedEffect(low1 + low2);
+				if (row2.none() || std::abs(total) > 2 * MaxLocal)
+					continue;
+
+				EffectSet matches = row1 & shifted(row2, total);
+				for (int bit = 0; matches.any() && bit < (int)matches.size(); ++bit)
+				{
+					int local1 = bit - MaxLocal;
+					if (matches[bit] && addPair(count1, low1, local1, count2, low2, total - local1, moves))
+						return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// Adds moves in two different records with those low sum deltas and local effects
+	bool addPair(int count1, int low1, int local1, int count2, int low2, int local2, std::vector<Move> &moves) const
+	{
+		std::vector<const FillerGroup *> groups1 = localGroups(count1, low1, local1);
+		std::vector<const FillerGroup *> groups2 = localGroups(count2, low2, local2);
+		for (const FillerGroup *group1 : groups1)
+			for (const FillerGroup *group2 : groups2)
+			{
+				std::vector<Move> found;
+				if (group1->Record != group2->Record && addLocal(found, *group1, count1, low1, local1) &&
+						addLocal(found, *group2, count2, low2, local2))
+				{
+					moves = found;
+					return true;
+				}
+			}
+		return false;
+	}
+
+	// The groups whose tables have count changes with that low sum delta and local effect
+	std::vector<const FillerGroup *> localGroups(int count, int low, int local) const
+	{
+		std::vector<const FillerGroup *> found;
+		for (const FillerGroup &group : groups)
+		{
+			u_char checkByte = checkBytes[group.Classes.front()];
+			int first = group.Summed ? low : -count * MaxDelta, last = group.Summed ? low : count * MaxDelta;
+			for (int delta = first; delta <= last; ++delta)
+				if (test(group.Digits[count - 1][delta + count * MaxDelta], local - checkEffect(checkByte, delta)))
+				{
+					found.push_back(&group);
+					break;
+				}
+		}
+		return found;
+	}
+
+	// One change in each of any number of records, by going through the records and tabulating what the changes so
+	// far can do. Each record offers the change of each byte delta whose effect on it is smallest.
+	bool searchSpread(int discrepancy, std::vector<Move> &moves)
+	{
+		tabulate(1);
+		std::vector<const FillerGroup *> spread;
+		std::vector<SpreadTable> reached{SpreadTable(2 * MaxSpread + 1)};
+		reached.front()[MaxSpread].set(MaxSpread);
+		auto solution = [&](int &low, int &local)
+		{
+			for (low = -MaxSpread; low <= MaxSpread; ++low)
+			{
+				local = discrepancy - storedEffect(low);
+				if (std::abs(local) <= MaxSpread && reached.back()[low + MaxSpread][local + MaxSpread])
+					return true;
+			}
+			return false;
+		};
+
+		int low, local;
+		for (const FillerGroup &group : groups)
+		{
+			if (solution(low, local))
+				break;
+			auto sameRecord = [&](const FillerGroup *other) { return other->Record == group.Record; };
+			if (std::any_of(spread.begin(), spread.end(), sameRecord))
+				continue;
+
+			spread.push_back(&group);
+			const SpreadTable &before = reached.back();
+			SpreadTable after(before);
+			for (const GroupChange &change : spreadChanges(group))
+			{
+				int groupLow = group.Summed ? change.Delta : 0, groupLocal = spreadLocal(group, change);
+				for (int from = -MaxSpread; from <= MaxSpread; ++from)
+					if (std::abs(from + groupLow) <= MaxSpread && before[from + MaxSpread].any())
+						after[from + groupLow + MaxSpread]|= shifted(before[from + MaxSpread], groupLocal);
+			}
+			reached.push_back(std::move(after));
+		}
+		if (!solution(low, local))
+			return false;
+
+		// Going back through the records, each has either no change or one leading back to what was reached before it
+		for (size_t index = spread.size(); index-- > 0;)
+		{
+			const SpreadTable &before = reached[index];
+			if (before[low + MaxSpread][local + MaxSpread])
+				continue;
+
+			const FillerGroup &group = *spread[index];
+			for (const GroupChange &change : spreadChanges(group))
+			{
+				int restLow = low - (group.Summed ? change.Delta : 0), restLocal = local - spreadLocal(group, change);
+				if (std::abs(restLow) <= MaxSpread && std::abs(restLocal) <= MaxSpread &&
+						before[restLow + MaxSpread][restLocal + MaxSpread])
+				{
+					addMoves(moves, group, 1, change.Delta, change.Digits);
+					low = restLow;
+					local = restLocal;
+					break;
+				}
+			}
+		}
+		return true;
+	}
+
+	// The change of group by each byte delta whose effect on its record is smallest
+	std::vector<GroupChange> spreadChanges(const FillerGroup &group) const
+	{
+		std::vector<GroupChange> changes;
+		for (int delta = -MaxDelta; delta <= MaxDelta; ++delta)
+		{
+			bool found = false;
+			for (int digits = -MaxDigits; digits <= MaxDigits; ++digits)
+			{
+				GroupChange change{delta, digits};
+				if (!test(group.Digits[0][delta + MaxDelta], digits))
+					continue;
+				if (!found)
+					changes.push_back(change);
+				else if (std::abs(spreadLocal(group, change)) < std::abs(spreadLocal(group, changes.back())))
+					changes.back() = change;
+				found = true;
+			}
+		}
+		return changes;
+	}
+
+	int spreadLocal(const FillerGroup &group, const GroupChange &change) const
+	{
+		return change.Digits + checkEffect(checkBytes[group.Classes.front()], change.Delta);
+	}
+
+	// The single move that brings the discrepancy closest to zero
+	bool bestSingle(int discrepancy, std::vector<Move> &moves) const
+	{
+		int bestRemaining = std::abs(discrepancy);
+		for (size_t fillerClass = 0; fillerClass < classes.size(); ++fillerClass)
+		{
+			if (!available(fillerClass))
+				continue;
+
+			for (u_int newValue = 0; newValue < 0x100; ++newValue)
+			{
+				Move move{fillerClass, (u_char)newValue};
+				int remaining = std::abs(discrepancy - localEffect(move) - storedEffect(lowDelta(move)));
+				if (remaining < bestRemaining)
+				{
+					bestRemaining = remaining;
+					moves = {move};
+				}
+			}
+		}
+		return !moves.empty();
+	}
+
+	HexFile &image;
+	size_t storedRecord;
+	std::vector<FillerClass> classes;
+	std::vector<u_char> checkBytes;
+	uint16_t storedSum;
+	u_char storedCheck;
+	std::vector<FillerGroup> groups;
+	std::array<std::vector<EffectSet>, MaxChanges> locals, reversedLocals;
+	std::array<int, MaxChanges> lowest, highest;
+	int tabulated;
+};
@@ -1,117 +1,113 @@
 #include "USBKeys.inl"
+#include "HexFile.inl"
+#include "HexImage.inl"
+#include "KeyTable.inl"
+#include "Firmware.inl"
+#include "KeyDump.inl"
 
 #include <iostream>
 #include <fstream>
-#include <unordered_map>
+#include <string_view>
 #include <iomanip>
 #include <vector>
+#include <cstring>
+#include <chrono>
+#include <unistd.h>
 
 using namespace std;
 
-template <typename T>
-T hexRead(istream &is, int &checkSum)
-{
-	T item = 0;
-	for (u_int i = 0; i < sizeof(item); ++i)
-	{
-		for (u_int j = 0; j < 2; ++j)
-		{
-			u_char ch;
-			is >> ch;
-			if (!isxdigit(ch))
-				throw runtime_error("Expected hex digit, got "s + to_string(ch));
-
-			u_char nybble = (ch <= '9') ? ch - '0' : toupper(ch) - '7';
-			item = (item << 4) | nybble;
-		}
-		checkSum-= item & 0xff;
-	}
-	return item;
-}
-
 int
-main(void)
+main(int ac, char *av[])
 {
-	bool verbose = false;
+	const char *inputPath = nullptr;
+	string format = "text";
+	u_int numCandidates = 0;
+	bool locate = false;
 
 	ios_base::sync_with_stdio(false);
 	freopen(NULL, "rb", stdin);
 
-	USBKeys keys;
-
-	// TODO: Use HexFile.inl
-	u_int segmentStart = 0;
-	cin.exceptions(ifstream::failbit | ifstream::badbit);
-	while (cin)
-	{
-		char colon;
-		cin >> colon;
-		if (colon != ':')
-			throw runtime_error("Expected : on input, got "s + colon + '(' + to_string(colon) + ')');
-
-		int checkSum = 0;
-		u_char len = hexRead<u_char>(cin, checkSum);
-		u_int addr = hexRead<u_short>(cin, checkSum);
-		addr+= segmentStart;
-		u_char recType = hexRead<u_char>(cin, checkSum);
-
-		if (verbose)
-			clog << "Record type " << (u_int)recType << " at " << addr << ", length " << (u_int)len << endl;
-
-		switch (recType)
+	int ch;
+	while ((ch = getopt(ac, av, "ai:l:o:")) != -1)
+		switch (ch)
 		{
-			case 0x0:
-				static const u_int startOffset = 4;
-				static const u_int bytesPerLine = 8;
-				for (auto i = 0; i < len; ++i)
-				{
-					u_char byte = hexRead<u_char>(cin, checkSum);
-
-					if (addr >= 0xbf4 && addr < 0xc8c)
-					{
-						if (((i - startOffset) % bytesPerLine) == 0)
-							cout << endl << hex << setw(4) << setfill('0') << addr << ':';
-
-						u_char scanCode = byte;
-						char leftDelim = '(', rightDelim = ')';
-						if (scanCode >= 0xe0)
-						{
-							leftDelim = '<';
-							rightDelim = '>';
-							scanCode-= 0x10;
-						}
-
-						auto keyName = keys.keyCodes.find(scanCode);
-
-						cout << ' '
-								<< leftDelim << setw(USBKeys::maxKeyNameLength) << setfill(' ')
-								<< ((keyName != keys.keyCodes.end()) ? keyName->second : "???"s) << rightDelim
-								<< hex << setw(2) << setfill('0') << (u_int)byte;
-					}
-
-					++addr;
-				}
-				if (verbose)
-					clog << endl;
+			case 'a':
+				locate = true;
 				break;
 
-			case 0x1:
-				return 0;
+			case 'i':
+				inputPath = optarg;
+				break;
 
-			case 0x4:
-				segmentStart = hexRead<u_short>(cin, checkSum) << 8;
-				if (verbose)
-					clog << "New segment start " << hex << setw(6) << segmentStart << endl;
+			case 'l':
+				numCandidates = stoul(optarg);
 				break;
 
+			case 'o':
+				format = optarg;
+				if (format == "text" || format == "json" || format == "binary")
+					break;
+				[[fallthrough]];
+
 			default:
-				throw runtime_error("Unknown record type " + to_string(recType));
+				cerr << "usage: " << av[0] << " [-a] [-i <file.hex>] [-o text|json|binary] [< <file.hex>]" << endl;
+				cerr << "       " << av[0] << " -l <count> [-i <file.hex>] [< <file.hex>]" << endl;
+				cerr << "-a\t\tLocate the table by its contents instead of taking it from the known images, or " <<
+						hex << KeyTable::DefaultBegin << endl;
+				cerr << "-i <file.hex>\tRead the image from a file, through its binary sidecar, instead of stdin" << endl;
+				cerr << "-l <count>\tList the count best scoring table locations and exit" << endl;
+				cerr << "-o <format>\tWrite aligned text (default), a JSON array, or packed " <<
+						KeyDump::EntrySize << "-byte entries" << endl;
+				return 64; // EX_USAGE
+		}
+
+	HexFile input;
+	if (inputPath)
+		HexImage::Load(inputPath, input);
+	else if (!(cin >> input))
+		throw runtime_error("Could not load HexFile from input");
+
+	u_int tableBegin = KeyTable::DefaultBegin, tableEnd = KeyTable::DefaultEnd;
+	const Firmware::Entry *firmware = Firmware::Identify(input);
+	if (firmware)
+	{
+		tableBegin = firmware->TableBegin;
+		tableEnd = firmware->TableEnd;
+	}
+
+	if (numCandidates > 0 || locate)
+	{
+		KeyTable keyTable;
+		auto start = chrono::steady_clock::now();
+		auto candidates = keyTable.Locate(input, max<u_int>(numCandidates, 1));
+		double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		if (candidates.empty())
+			throw runtime_error("Image is smaller than the table");
+
+		if (numCandidates > 0)
+		{
+			if (firmware)
+				clog << "Image is " << firmware->Name << ", table at " << hex << firmware->TableBegin << endl;
+			else
+				clog << "Unknown image, hash " << hex << setw(16) << setfill('0') << Firmware::Hash(input) << endl;
+
+			for (const KeyTable::Candidate &candidate : candidates)
+				cout << hex << setw(4) << setfill('0') << candidate.Begin << ": " << dec << candidate.Score << endl;
+			clog << "Scored the image in " << elapsed << " ms" << endl;
+			return 0;
 		}
 
-		int dummy;
-		u_char checkByte = hexRead<u_char>(cin, dummy);
-		if (checkByte != (checkSum & 0xff))
-			throw runtime_error("Invalid check byte "s + to_string(checkByte) + " should be " +
-					to_string(checkSum & 0xff));
+		tableEnd = candidates[0].Begin + (tableEnd - tableBegin);
+		tableBegin = candidates[0].Begin;
 	}
+
+	KeyDump keys(input, tableBegin, tableEnd);
+	if (format == "json")
+		keys.WriteJSON(cout);
+	else if (format == "binary")
+		keys.WriteBinary(cout);
+	else
+		keys.WriteText(cout);
+
+	return 0;
 }
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "HexFile.inl"
+
+#include <array>
+#include <algorithm>
+#include <cstdint>
+
+// Firmware images we know about. An image is identified by a hash of its flash contents that leaves out the scancode
+// table and the stored low sum, so an image whose patches only remap keys is identified as the one it was made from.
+// Patches that change other bytes, and filler bytes changed by Patch -c, give an image a hash of its own. Run
+// FindKeys -l or Upload on an unknown image to get its hash.
+class Firmware
+{
+public:
+	struct Entry
+	{
+		const char *Name;
+		uint64_t ImageHash;						// Or NotRecorded
+		std::array<uint16_t, 4> ProductIDs;		// Keyboards it runs on, 0 for unused
+		uint16_t BcdDevice;						// Version the keyboard reports once it is running this image
+		u_int TableBegin, TableEnd;				// Scancode table
+		uint16_t BeginSummed, EndSummed, StoredSumAddress;
+		u_int LoaderEnd;						// Blocks at and above this are not written by the loader
+
+		bool RunsOn(uint16_t productID) const
+		{
+			return productID != 0 && std::find(ProductIDs.begin(), ProductIDs.end(), productID) != ProductIDs.end();
+		}
+	};
+
+	static constexpr uint64_t NotRecorded = 0;
+
+	static constexpr Entry Known[] =
+	{
+		// The hash of the image from AlKybdFirmwareUpdate.pkg has yet to be recorded here; until it is, Upload only
+		// warns that the image is unknown
+		{"kbd_0x0069_0x0220", NotRecorded, {0x220, 0x24f}, 0x0069, 0xbf4, 0xc8c, 0x80, 0x1300, 0x1ffe, 0x10000},
+	};
+
+	// FNV-1a over the flash bytes below LoaderEnd, skipping entry's table and stored sum, with missing bytes as 0
+	static uint64_t Hash(const HexFile &hexFile, const Entry &layout = Known[0])
+	{
+		uint64_t hash = 0xcbf29ce484222325;
+		for (u_int address = 0; address < layout.LoaderEnd; ++address)
+		{
+			if ((address >= layout.TableBegin && address < layout.TableEnd) ||
+					(address >= layout.StoredSumAddress && address < layout.StoredSumAddress + 2u))
+				continue;
+
+			u_char byte = hexFile.IsPresent(address) ? hexFile[address] : 0;
+			hash = (hash ^ byte) * 0x100000001b3;
+		}
+
+		return hash;
+	}
+
+	// Or null if the image is not one we know
+	static const Entry *Identify(const HexFile &hexFile)
+	{
+		for (const Entry &entry : Known)
+			if (entry.ImageHash != NotRecorded && Hash(hexFile, entry) == entry.ImageHash)
+				return &entry;
+
+		return nullptr;
+	}
+};
@@ -0,0 +1,140 @@
+#include "HexFile.inl"
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
+
+using namespace std;
+
+// Heap allocations made so far, so the benchmark can tell how many loading an image takes. Counting them means
+// replacing the global allocator, which is why the benchmark is a program of its own rather than an option of Patch.
+static atomic<size_t> numAllocations;
+
+void *
+operator new(size_t size)
+{
+	++numAllocations;
+	if (void *memory = malloc(size ? size : 1))
+		return memory;
+	throw bad_alloc();
+}
+
+void
+operator delete(void *memory) noexcept
+{
+	free(memory);
+}
+
+void
+operator delete(void *memory, size_t) noexcept
+{
+	free(memory);
+}
+
+// The original per-byte iostream formatting, which the buffered writer must match byte for byte
+static void
+writeReference(ostream &os, const HexFile &hexFile)
+{
+	os << hex << noshowbase << setfill('0');
+	for (const HexFile::Record &record : hexFile.records)
+	{
+		int checkSum = 0;
+		auto put = [&](u_char ch)
+		{
+			os << setw(2) << (u_int)ch;
+			checkSum-= ch;
+		};
+
+		os << ':';
+		put(record.length);
+		put(record.address >> 8);
+		put(record.address & 0xff);
+		put(record.type);
+		if (record.type == 0)
+			for (u_char ch : record)
+				put(ch);
+		else
+			for (u_int index = 0; index < record.ValueLength(); ++index)
+				put(record.value >> ((record.ValueLength() - 1 - index) * 8));
+		put(checkSum & 0xff);
+		os << "\r\n";
+	}
+}
+
+static int
+benchmark(const HexFile &hexFile, u_int count)
+{
+	ostringstream reference, buffered;
+	auto timeIt = [&](ostringstream &os, auto &&write)
+	{
+		auto start = chrono::steady_clock::now();
+		for (u_int i = 0; i < count; ++i)
+		{
+			os.str("");
+			write(os);
+		}
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	};
+
+	double referenceTime = timeIt(reference, [&](ostream &os) { writeReference(os, hexFile); });
+	double bufferedTime = timeIt(buffered, [&](ostream &os) { os << hexFile; });
+	double megabytes = (reference.str().size() * (double)count) / 1048576.0;
+
+	clog << "Wrote " << hexFile.records.size() << " records " << count << " times:" << endl;
+	clog << left;
+	clog << "  " << setw(20) << "iostream per byte:" << megabytes / referenceTime << " MB/s" << endl;
+	clog << "  " << setw(20) << "buffered table:" << megabytes / bufferedTime << " MB/s" << endl;
+
+	if (buffered.str() != reference.str())
+	{
+		cerr << "Output does not match the iostream reference" << endl;
+		return 1;
+	}
+
+	const string text = buffered.str();
+	size_t loadAllocations = 0;
+	auto start = chrono::steady_clock::now();
+	for (u_int i = 0; i < count; ++i)
+	{
+		istringstream is(text);
+		HexFile loaded;
+		size_t allocationsBefore = numAllocations;
+		is >> loaded;
+		loadAllocations+= numAllocations - allocationsBefore;
+	}
+	double loadTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	clog << "Loaded " << count << " times:" << endl;
+	clog << "  " << setw(20) << "parse and build:" << megabytes / loadTime << " MB/s, " <<
+			(double)loadAllocations / count << " allocations per image" << endl;
+
+	return 0;
+}
+
+int
+main(int ac, char *av[])
+{
+	ios_base::sync_with_stdio(false);
+	freopen(NULL, "rb", stdin);
+
+	u_int count = (ac == 2) ? strtoul(av[1], nullptr, 10) : 0;
+	if (count == 0)
+	{
+		cerr << "usage: " << getprogname() << " <count> < <file.hex>" << endl;
+		cerr << "Benchmarks writing and loading the image count times, checking the output against per-byte iostream "
+				"formatting" << endl;
+		return 64; // EX_USAGE
+	}
+
+	HexFile input;
+	if (!(cin >> input))
+		throw runtime_error("Could not load HexFile from input");
+
+	return benchmark(input, count);
+}
@@ -1,285 +1,669 @@
+#pragma once
+
+#include "HexParser.inl"
+#include "Simd.inl"
+
+#include <array>
 #include <iostream>
 #include <vector>
-#include <variant>
 #include <iomanip>
-
-class HexReader
+#include <optional>
+#include <bitset>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+
+// Define as 1 to cross-check the running low sum against a full SumLowBlocks() on every use
+#ifndef HEXFILE_CHECK_LOW_SUM
+#	define HEXFILE_CHECK_LOW_SUM 0
+#endif
+
+// Formats records into a preallocated buffer, two lower case digits per byte from a table, computing each check byte
+// along the way
+class HexWriter
 {
 public:
-	HexReader(std::istream &stream) : stream(stream), checkSum(0) { }
-
-	template <typename T>
-	HexReader &operator>>(T &item)
+	// Characters taken by a record with dataLength bytes of data, including the colon and line ending
+	static constexpr size_t RecordSize(size_t dataLength)
 	{
-		item = 0;
-		for (u_int i = 0; i < sizeof(item); ++i)
-		{
-			for (u_int j = 0; j < 2; ++j)
-			{
-				u_char ch;
-				stream >> ch;
-				if (!isxdigit(ch))
-					throw std::runtime_error(std::string("Expected hex digit, got ") + std::to_string(ch));
-
-				u_char nybble = (ch <= '9') ? ch - '0' : toupper(ch) - '7';
-				item = (item << 4) | nybble;
-			}
-			checkSum-= item & 0xff;
-		}
-		return *this;
+		return 1 + (4 + dataLength + 1) * 2 + 2;
 	}
 
-	std::istream &stream;
-	int checkSum;
-};
+	HexWriter(char *position) : position(position) { }
 
-class HexWriter
-{
-public:
-	HexWriter(std::ostream &stream) : stream(stream), checkSum(0)
+	void Write(u_char length, uint16_t address, u_char type, const u_char *data, size_t dataLength)
 	{
-		stream << std::hex << std::noshowbase << std::setfill('0');
+		*position++ = ':';
+		checkSum = 0;
+		put(length);
+		put(address >> 8);
+		put(address & 0xff);
+		put(type);
+		for (size_t i = 0; i < dataLength; ++i)
+			put(data[i]);
+		put(-checkSum);
+		*position++ = '\r';
+		*position++ = '\n';
 	}
 
-	template <typename T>
-	HexWriter &operator<<(const T &item)
+	char *GetPosition() const { return position; }
+
+private:
+	static constexpr std::array<char, 512> digitPairs = []
 	{
-		int shift = (sizeof(item) - 1) << 3;
-		do
+		std::array<char, 512> pairs{};
+		const char digits[] = "0123456789abcdef";
+		for (size_t byte = 0; byte < 256; ++byte)
 		{
-			u_char ch = (item >> shift) & 0xff;
-			stream << std::setw(2) << (u_int)ch;
-			checkSum-= ch;
-			shift-= 8;
+			pairs[byte * 2] = digits[byte >> 4];
+			pairs[byte * 2 + 1] = digits[byte & 0xf];
 		}
-		while (shift >= 0);
+		return pairs;
+	}();
 
-		return *this;
+	void put(u_char byte)
+	{
+		position[0] = digitPairs[byte * 2];
+		position[1] = digitPairs[byte * 2 + 1];
+		position+= 2;
+		checkSum+= byte;
 	}
 
-	std::ostream &stream;
-	int checkSum;
+	char *position;
+	u_char checkSum = 0;
 };
 
 class HexFile
 {
 public:
+	// A record as it appeared in the file. Data records are views into the image, so writes through either show up in
+	// both, and the original record layout is written back out.
 	class Record
 	{
 	public:
-		u_char &operator[](u_int address)
+		u_char &operator[](u_int offset)
 		{
-			return std::get<std::vector<u_char>>(data)[address];
+			return data[offset];
 		}
 
-		const u_char &operator[](u_int address) const
+		const u_char &operator[](u_int offset) const
 		{
-			return std::get<std::vector<u_char>>(data)[address];
+			return data[offset];
+		}
+
+		const u_char *begin() const { return data; }
+		const u_char *end() const { return data ? data + length : data; }
+
+		u_int LinearAddress() const { return base + address; }
+
+		// Types 2 and 4 carry a 16-bit segment, types 3 and 5 a 32-bit start address
+		u_char ValueLength() const
+		{
+			return (type == 2 || type == 4) ? 2 : (type == 3 || type == 5) ? 4 : 0;
+		}
+
+		// Bytes following the type in the file
+		u_char PayloadLength() const
+		{
+			return (type == 0) ? length : ValueLength();
 		}
 
 		u_char length;
 		u_int address;
 		u_char type;
-		std::variant<std::vector<u_char>, uint16_t> data;
+		u_int base = 0;				// Linear address of offset 0, from the last type 2 or 4 record before this one
+		u_int value = 0;			// Types 2 to 5
+		u_char *data = nullptr;		// Type 0 only
 
-		friend std::istream &operator>>(std::istream &is, HexFile::Record &record);
 		friend std::ostream &operator<<(std::ostream &os, const HexFile::Record &record);
 	};
 
-	u_char &operator[](u_int address)
+	// Writing through a ByteRef keeps the running low sum and the dirty blocks up to date
+	class ByteRef
 	{
-		for (auto &record : records)
-			if (record.address <= address && record.address + record.length > address)
-				return record[address - record.address];
+	public:
+		operator u_char() const { return byte; }
+
+		ByteRef &operator=(u_char value)
+		{
+			hexFile.write(address, byte, value);
+			return *this;
+		}
 
-		throw std::out_of_range(std::string("No record at address ") + std::to_string(address));
+		ByteRef &operator=(const ByteRef &other) { return *this = (u_char)other; }
+
+	private:
+		friend class HexFile;
+		ByteRef(HexFile &hexFile, u_int address, u_char &byte) : hexFile(hexFile), address(address), byte(byte) { }
+
+		HexFile &hexFile;
+		u_int address;
+		u_char &byte;
+	};
+
+	HexFile() = default;
+	HexFile(HexFile &&) = default;
+	HexFile &operator=(HexFile &&) = default;
+
+	HexFile(const HexFile &other)
+	{
+		*this = other;
+	}
+
+	HexFile &operator=(const HexFile &other)
+	{
+		records = other.records;
+		pages = other.pages;
+		segmentSlots = other.segmentSlots;
+		pageTables = other.pageTables;
+		image = other.image;
+		present = other.present;
+		lowSum = other.lowSum;
+		dirtyBlocks = other.dirtyBlocks;
+
+		for (Record &record : records)
+			if (record.data)
+				record.data = image.data() + (record.data - other.image.data());
+		return *this;
+	}
+
+	// Addresses are linear, i.e. the base set by type 2 or 4 records plus the record address
+	ByteRef operator[](u_int address)
+	{
+		return ByteRef(*this, address, image[find(address)]);
 	}
 
 	const u_char &operator[](u_int address) const
 	{
-		for (auto &record : records)
-			if (record.address <= address && record.address + record.length > address)
-				return record[address - record.address];
+		return image[find(address)];
+	}
 
-		throw std::out_of_range(std::string("No record at address ") + std::to_string(address));
+	// Copies length bytes to address a page at a time, keeping the low sum and dirty blocks up to date like operator[]
+	void Write(u_int address, const u_char *bytes, size_t length)
+	{
+		while (length > 0)
+		{
+			size_t index = find(address);
+			size_t runLength = std::min<size_t>(length, PageSize - address % PageSize);
+			for (size_t offset = 1; offset < runLength; ++offset)
+				if (!isPresent(index + offset))
+					throw std::out_of_range(std::string("No record at address ") + std::to_string(address + offset));
+
+			u_int summedBegin = std::max<u_int>(address, BeginSummed);
+			u_int summedEnd = std::min<u_int>(address + runLength, EndSummed);
+			if (lowSum && summedBegin < summedEnd)
+				*lowSum+= Simd::SumBytes(bytes + summedBegin - address, summedEnd - summedBegin) -
+						Simd::SumBytes(image.data() + index + summedBegin - address, summedEnd - summedBegin);
+
+			std::copy(bytes, bytes + runLength, image.data() + index);
+			for (u_int block = address / FlashBlockSize; block <= (address + runLength - 1) / FlashBlockSize &&
+					block < dirtyBlocks.size(); ++block)
+				dirtyBlocks.set(block);
+
+			address+= runLength;
+			bytes+= runLength;
+			length-= runLength;
+		}
+	}
+
+	bool IsPresent(u_int address) const
+	{
+		size_t index = pageIndex(address);
+		return index != NoPage && isPresent(index + address % PageSize);
+	}
+
+	// The FlashBlockSize bytes of the block holding address, or null if its first byte is missing. After Reblock() a
+	// block is either all there or all missing.
+	const u_char *GetBlock(u_int address) const
+	{
+		u_int blockAddress = address - address % FlashBlockSize;
+		size_t index = pageIndex(blockAddress);
+		if (index == NoPage || !isPresent(index + blockAddress % PageSize))
+			return nullptr;
+
+		return image.data() + index + blockAddress % PageSize;
 	}
 
 	std::vector<Record> records;
 
 	uint16_t GetStoredLowSum() const
 	{
-		return (*this)[0x1ffe] << 8 | (*this)[0x1fff];
+		return (*this)[StoredSumAddress] << 8 | (*this)[StoredSumAddress + 1];
 	}
 
 	// Checksum is 16-bit sum of bytes in this range:
 	static const uint16_t BeginSummed = 0x80, EndSummed = 0x1300;
+	static const uint16_t StoredSumAddress = 0x1ffe;
+
+	// Running sum of the low blocks, computed in full once and then adjusted by every write
+	uint16_t GetLowSum() const
+	{
+		if (!lowSum)
+			lowSum = SumLowBlocks();
+#if HEXFILE_CHECK_LOW_SUM
+		else if (*lowSum != SumLowBlocks())
+			throw std::logic_error("Running low sum " + std::to_string(*lowSum) + " should be " +
+					std::to_string(SumLowBlocks()));
+#endif
+		return *lowSum;
+	}
 
+	// Bytes missing from the image count as 0
 	uint16_t SumLowBlocks() const
 	{
-		uint16_t segment = 0;
 		uint16_t computedSum = 0;
+		for (u_int address = BeginSummed; address < EndSummed; )
+		{
+			u_int pageEnd = std::min<u_int>((address / PageSize + 1) * PageSize, EndSummed);
+			size_t index = pageIndex(address);
+			if (index != NoPage)
+				computedSum+= Simd::SumBytes(image.data() + index + address % PageSize, pageEnd - address);
+			address = pageEnd;
+		}
 
-		for (const Record &record : records)
+		return computedSum;
+	}
+
+	void UpdateLowSum()
+	{
+		uint16_t computedSum = GetLowSum();
+
+		(*this)[StoredSumAddress] = computedSum >> 8;
+		(*this)[StoredSumAddress + 1] = computedSum;
+	}
+
+	// The loader writes flash in aligned blocks of this size, up to FlashEnd
+	static const u_int FlashBlockSize = 64;
+	static const u_int FlashEnd = 0x10000;
+
+	// Bytes of a flash block that no record supplied, from Begin up to End
+	struct Gap
+	{
+		u_int Begin, End;
+	};
+
+	// Writes made directly through records bypass tracking; call this afterwards
+	void ResetTracking()
+	{
+		lowSum.reset();
+		dirtyBlocks.reset();
+	}
+
+	// Flash blocks written through operator[] or Write() since loading or ResetTracking(), indexed by block number.
+	// Writes at and above FlashEnd are not tracked.
+	const std::bitset<FlashEnd / FlashBlockSize> &GetDirtyBlocks() const
+	{
+		return dirtyBlocks;
+	}
+
+	// Replaces the data records in flash with one aligned FlashBlockSize record for every block holding any data, in
+	// address order and ahead of the other records, which are kept as they are. Bytes of those blocks that no record
+	// supplied are set to filler and returned. An image that is already blocked is left untouched.
+	std::vector<Gap> Reblock(u_char filler = 0)
+	{
+		auto inFlash = [](const Record &record)
 		{
-			switch (record.type)
+			return record.type == 0 && record.LinearAddress() + record.length <= FlashEnd;
+		};
+		auto straddles = [](const Record &record)
+		{
+			return record.type == 0 && record.LinearAddress() < FlashEnd && record.LinearAddress() + record.length > FlashEnd;
+		};
+
+		if (std::all_of(records.begin(), records.end(), [&](const Record &record)
+				{
+					return (!inFlash(record) && !straddles(record)) ||
+							(record.base == 0 && record.length == FlashBlockSize && record.address % FlashBlockSize == 0);
+				}))
+			return {};
+
+		// Each block is one word of the presence bitmap, since pages are stored on block boundaries
+		static_assert(PageSize % FlashBlockSize == 0 && FlashBlockSize == 64);
+
+		std::vector<Gap> gaps;
+		std::vector<Record> blocked;
+		for (size_t pageNum = 0; pageNum < pages.size() && pages[pageNum] < FlashEnd / PageSize; ++pageNum)
+			for (u_int blockOffset = 0; blockOffset < PageSize; blockOffset+= FlashBlockSize)
 			{
-				case 0:
+				size_t index = pageNum * PageSize + blockOffset;
+				uint64_t &word = present[index / 64];
+				if (word == 0)
+					continue;
+
+				u_int address = pages[pageNum] * PageSize + blockOffset;
+				for (u_int offset = 0; offset < FlashBlockSize && word != ~uint64_t(0); )
 				{
-					if (segment > 0)
+					if (word >> offset & 1)
+					{
+						++offset;
 						continue;
+					}
 
-					const uint16_t beginRecord = record.address, endRecord = record.address + record.length;
+					Gap gap{address + offset, address + offset};
+					for (; offset < FlashBlockSize && !(word >> offset & 1); ++offset, ++gap.End)
+						image[index + offset] = filler;
+					gaps.push_back(gap);
+				}
+				word = ~uint64_t(0);
+
+				Record record;
+				record.length = FlashBlockSize;
+				record.address = address;
+				record.type = 0;
+				record.data = image.data() + index;
+				blocked.push_back(record);
+			}
 
-					if (endRecord <= BeginSummed || beginRecord >= EndSummed)
-						continue;
+		// The blocks above hold the part of a record that straddles FlashEnd below it, so only the rest is kept, at an
+		// extended linear address of its own, after which the base the following records expect is set again
+		for (const Record &record : records)
+			if (straddles(record))
+			{
+				u_int split = FlashEnd - record.LinearAddress();
+				blocked.push_back(addressRecord(4, FlashEnd));
 
-					unsigned endOffset = record.length;
-					if (endRecord > EndSummed)
-						endOffset = EndSummed - beginRecord;
+				Record rest = record;
+				rest.length = record.length - split;
+				rest.address = 0;
+				rest.base = FlashEnd;
+				rest.data = record.data + split;
+				blocked.push_back(rest);
 
-					unsigned beginOffset = 0;
-					if (beginRecord < BeginSummed)
-						beginOffset = BeginSummed - beginRecord;
+				blocked.push_back(addressRecord((record.base % 0x10000 == 0) ? 4 : 2, record.base));
+			}
+			else if (!inFlash(record))
+				blocked.push_back(record);
+		records = std::move(blocked);
 
-					const std::vector<uint8_t> &data = std::get<std::vector<uint8_t>>(record.data);
-					for (unsigned offset = beginOffset; offset < endOffset; ++offset)
-						computedSum+= data[offset];
+		if (filler != 0 && !gaps.empty())
+			lowSum.reset();
+		return gaps;
+	}
 
-					break;
-				}
+	friend std::istream &operator>>(std::istream &, HexFile &);
+	friend class HexImage;
+
+private:
+	// The 32-bit linear address space is mapped through 256-byte pages. Pages holding data are stored in address order
+	// in the image, and each 64K segment with any such page has a table giving the image offset of each of its pages.
+	// A small open-addressed hash of segment numbers finds the table, so a lookup is constant time in any segment.
+	static constexpr u_int PageSize = 0x100, PagesPerSegment = 0x100;
+	static constexpr uint32_t NoPage = UINT32_MAX;
 
-				case 1:
-					break;
+	// Image offset of the page holding address, or NoPage
+	size_t pageIndex(u_int address) const
+	{
+		if (segmentSlots.empty())
+			return NoPage;
 
-				case 4:
-					segment = std::get<uint16_t>(record.data);
-					break;
+		uint32_t segment = address >> 16;
+		for (size_t slot = hashSegment(segment); ; slot = (slot + 1) & (segmentSlots.size() - 1))
+		{
+			uint32_t entry = segmentSlots[slot];
+			if (entry == 0)
+				return NoPage;
+			if (entry >> 16 == segment)
+			{
+				return pageTables[((entry & 0xffff) - 1) * PagesPerSegment + (address >> 8 & 0xff)];
 			}
 		}
+	}
 
-		return computedSum;
+	size_t hashSegment(uint32_t segment) const
+	{
+		return (segment * 0x9e3779b1u >> 16) & (segmentSlots.size() - 1);
 	}
 
-	void UpdateLowSum()
+	// Builds the segment hash and page tables for pages, which must be sorted; page n is stored at image[n * PageSize]
+	void buildPageMap()
 	{
-		uint16_t computedSum = SumLowBlocks();
+		size_t numSegments = 0;
+		for (size_t index = 0; index < pages.size(); ++index)
+			if (index == 0 || pages[index] >> 8 != pages[index - 1] >> 8)
+				++numSegments;
+
+		size_t numSlots = 4;
+		while (numSlots < numSegments * 2)
+			numSlots*= 2;
+		segmentSlots.assign(numSlots, 0);
+		pageTables.assign(numSegments * PagesPerSegment, NoPage);
+
+		size_t table = 0;
+		for (size_t index = 0; index < pages.size(); ++index)
+		{
+			uint32_t segment = pages[index] >> 8;
+			if (index == 0 || segment != pages[index - 1] >> 8)
+			{
+				size_t slot = hashSegment(segment);
+				while (segmentSlots[slot] != 0)
+					slot = (slot + 1) & (numSlots - 1);
+				segmentSlots[slot] = segment << 16 | ++table;
+			}
+			pageTables[(table - 1) * PagesPerSegment + (pages[index] & 0xff)] = index * PageSize;
+		}
+	}
 
-		(*this)[0x1ffe] = computedSum >> 8;
-		(*this)[0x1fff] = computedSum;
+	bool isPresent(size_t index) const
+	{
+		return present[index / 64] >> (index % 64) & 1;
 	}
 
-	friend std::istream &operator>>(std::istream &, HexFile &);
-	friend std::istream &operator>>(std::istream &is, HexFile::Record &record);
-	friend std::ostream &operator<<(std::ostream &os, const HexFile::Record &record);
-};
+	size_t find(u_int address) const
+	{
+		size_t index = pageIndex(address);
+		if (index == NoPage || !isPresent(index + address % PageSize))
+			throw std::out_of_range(std::string("No record at address ") + std::to_string(address));
 
-std::istream &operator>>(std::istream &is, HexFile::Record &record)
-{
-	char colon;
-	is >> colon;
-	if (colon != ':')
-		throw std::runtime_error(std::string("Expected : on input, got ") + colon + '(' + std::to_string(colon) + ')');
+		return index + address % PageSize;
+	}
 
-	HexReader hexReader{is};
-	u_short shortAddr;
-	hexReader >> record.length >> shortAddr >> record.type;
-	record.address = shortAddr;
+	void write(u_int address, u_char &byte, u_char value)
+	{
+		if (lowSum && address >= BeginSummed && address < EndSummed)
+			*lowSum+= value - byte;
+
+		byte = value;
+		if (address < FlashEnd)
+			dirtyBlocks.set(address / FlashBlockSize);
+	}
 
-	switch (record.type)
+	// An extended address record of type 2 or 4 setting the base of the records after it to base
+	static Record addressRecord(u_char type, u_int base)
 	{
-		case 0:
+		Record record;
+		record.length = 2;
+		record.address = 0;
+		record.type = type;
+		record.base = base;
+		record.value = (type == 4) ? base >> 16 : base >> 4;
+		return record;
+	}
+
+	// Lay out every page that holds data and point the records at it. Records are normally in address order with no
+	// gaps, in which case the loaded data already is the image and is moved in rather than copied.
+	void buildImage(std::vector<u_char> &&loaded)
+	{
+		pages.clear();
+		pages.reserve(loaded.size() / PageSize + records.size());
+		for (const Record &record : records)
+			if (record.type == 0 && record.length > 0)
+				for (u_int page = record.LinearAddress() / PageSize;
+						page <= (record.LinearAddress() + record.length - 1) / PageSize; ++page)
+					if (pages.empty() || pages.back() != page)
+						pages.push_back(page);
+		std::sort(pages.begin(), pages.end());
+		pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+		buildPageMap();
+
+		size_t size = pages.size() * PageSize;
+		bool inOrder = true;
+		size_t loadedOffset = 0;
+		for (const Record &record : records)
 		{
-			std::vector<u_char> &data = record.data.emplace<std::vector<u_char>>(record.length);
-			for (auto &ch : data)
-				hexReader >> ch;
-			break;
-		}
+			if (record.type != 0 || record.length == 0 || !inOrder)
+				continue;
 
-		case 1:
-			break;
+			inOrder = (imageIndex(record) == loadedOffset);
+			loadedOffset+= record.length;
+		}
 
-		case 4:
+		if (inOrder)
 		{
-			uint16_t segmentStart;
-			hexReader >> segmentStart;
-			record.data.emplace<uint16_t>(segmentStart);
-			break;
+			image = std::move(loaded);
+			image.resize(size, 0);
 		}
+		else
+			image.assign(size, 0);
+		present.assign((size + 63) / 64, 0);
 
-		default:
-			throw std::runtime_error("Unknown record type " + std::to_string(record.type));
-	}
+		loadedOffset = 0;
+		for (Record &record : records)
+		{
+			// An empty record has no bytes in the image, and may not even have a page
+			if (record.type != 0 || record.length == 0)
+			{
+				record.data = nullptr;
+				continue;
+			}
 
-	u_char sumSoFar = hexReader.checkSum & 0xff;
-	u_char checkByte;
-	hexReader >> checkByte;
-	if (checkByte != sumSoFar)
-		throw std::runtime_error(std::string("Invalid check byte ") + std::to_string(checkByte) + " should be " + std::to_string(sumSoFar));
+			size_t index = imageIndex(record);
+			if (!inOrder)
+				std::copy_n(loaded.begin() + loadedOffset, record.length, image.begin() + index);
+			markPresent(index, record.length);
 
-	return is;
-}
+			record.data = image.data() + index;
+			loadedOffset+= record.length;
+		}
 
-std::ostream &operator<<(std::ostream &os, const HexFile::Record &record)
-{
-	os << ':';
-	HexWriter hexWriter(os);
-	hexWriter << record.length << (u_short)record.address << record.type;
+		ResetTracking();
+	}
 
-	switch (record.type)
+	// Pages are in address order, so a record spanning several of them is contiguous in the image
+	size_t imageIndex(const Record &record) const
 	{
-		case 0:
-			for (auto &ch : std::get<std::vector<u_char>>(record.data))
-				hexWriter << ch;
-			break;
-
-		case 1:
-			break;
+		return pageIndex(record.LinearAddress()) + record.LinearAddress() % PageSize;
+	}
 
-		case 4:
-			u_short shortAddress = std::get<uint16_t>(record.data);
-			hexWriter << shortAddress;
-			break;
+	void markPresent(size_t index, size_t length)
+	{
+		for (size_t bit = index; bit < index + length; )
+		{
+			size_t numBits = std::min<size_t>(64 - bit % 64, index + length - bit);
+			present[bit / 64]|= ((numBits == 64) ? ~uint64_t(0) : ((uint64_t(1) << numBits) - 1)) << (bit % 64);
+			bit+= numBits;
+		}
 	}
 
-	hexWriter << (u_char)(hexWriter.checkSum & 0xff);
-	os << "\r\n";
-	return os;
+	std::vector<u_int> pages;				// Linear page numbers, sorted
+	std::vector<uint32_t> segmentSlots;		// Segment number << 16 | page table number + 1, or 0 for an empty slot
+	std::vector<uint32_t> pageTables;		// PagesPerSegment image offsets per segment, or NoPage
+	std::vector<u_char> image;
+	std::vector<uint64_t> present;
+	mutable std::optional<uint16_t> lowSum;
+	std::bitset<FlashEnd / FlashBlockSize> dirtyBlocks;
+};
+
+// Formats a record into buffer, which must have room for HexWriter::RecordSize(record.PayloadLength()) characters
+static char *formatRecord(char *buffer, const HexFile::Record &record)
+{
+	u_char value[4];
+	for (u_int index = 0; index < record.ValueLength(); ++index)
+		value[index] = record.value >> ((record.ValueLength() - 1 - index) * 8);
+
+	HexWriter hexWriter(buffer);
+	hexWriter.Write(record.length, record.address, record.type, (record.type == 0) ? record.begin() : value,
+			record.PayloadLength());
+	return hexWriter.GetPosition();
+}
+
+std::ostream &operator<<(std::ostream &os, const HexFile::Record &record)
+{
+	char buffer[HexWriter::RecordSize(0xff)];
+	return os.write(buffer, formatRecord(buffer, record) - buffer);
 }
 
 std::istream &operator>>(std::istream &is, HexFile &hexFile)
 {
 	static const bool verbose = false;
 
+	std::vector<u_char> text = HexParser::ReadAll(is);
+	HexParser parser(text.data(), text.data() + text.size());
+
+	// Every record starts with a colon and holds at most half as many bytes as it has characters, so these bound
+	// what is loaded and nothing is reallocated while parsing
+	hexFile.records.clear();
+	hexFile.records.reserve(std::count(text.begin(), text.end(), ':'));
+	std::vector<u_char> loaded;
+	loaded.reserve(text.size() / 2);
+
+	u_int base = 0;
 	bool done = false;
-	do
+	HexParser::Record parsed;
+	while (!done && parser.Next(parsed))
 	{
 		HexFile::Record record;
-		if (is >> record)
-		{
-			if (done)
-				throw std::runtime_error("Additional records after end record");
+		record.length = parsed.Length;
+		record.address = parsed.Address;
+		record.type = parsed.Type;
+		record.base = base;
 
-			if (verbose)
-				std::clog << "Record type " << (u_int)record.type << " at " << std::hex << std::setw(6) << record.address << ", length " << std::dec << (u_int)record.length << std::endl;
+		if (verbose)
+			std::clog << "Record type " << (u_int)record.type << " at " << std::hex << std::setw(6) << record.address << ", length " << std::dec << (u_int)record.length << std::endl;
 
-			if (record.type == 1)
-				done = true;
+		switch (record.type)
+		{
+			case 0:
+				loaded.insert(loaded.end(), parsed.Data, parsed.Data + parsed.Length);
+				break;
 
-			hexFile.records.push_back(record);
+			case 1:
+				done = true;
+				break;
+
+			case 2:
+			case 3:
+			case 4:
+			case 5:
+				if (parsed.Length != record.ValueLength())
+					throw std::runtime_error("Invalid length " + std::to_string(parsed.Length) + " for record type " +
+							std::to_string(record.type));
+
+				for (u_int index = 0; index < parsed.Length; ++index)
+					record.value = record.value << 8 | parsed.Data[index];
+
+				// Extended segment addresses are paragraphs, extended linear addresses the upper 16 bits
+				if (record.type == 2)
+					base = record.value << 4;
+				else if (record.type == 4)
+					base = record.value << 16;
+				break;
+
+			default:
+				throw std::runtime_error("Unknown record type " + std::to_string(record.type));
 		}
+
+		hexFile.records.push_back(std::move(record));
 	}
-	while (is && !done);
 
 	if (!done)
 		std::cerr << "Warning: Expected end record before EOF" << std::endl;
 
+	hexFile.buildImage(std::move(loaded));
+
 	return is;
 }
 
+// The whole image is formatted into one buffer and written at once
 std::ostream &operator<<(std::ostream &os, const HexFile &hexFile)
 {
+	size_t size = 0;
+	for (auto &record : hexFile.records)
+		size+= HexWriter::RecordSize(record.PayloadLength());
+
+	std::vector<char> text(size);
+	char *position = text.data();
 	for (auto &record : hexFile.records)
-		os << record;
+		position = formatRecord(position, record);
 
-	return os;
+	return os.write(text.data(), text.size());
 }
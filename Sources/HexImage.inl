@@ -0,0 +1,330 @@
+#pragma once
+
+#include "HexFile.inl"
+#include "SyscallError.inl"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Binary copy of a loaded HexFile, kept next to its .hex as <file>.img so that later runs map it instead of parsing
+// the text. The header holds the size and a hash of the contents of the .hex it was made from; when either has
+// changed the sidecar is stale, and the .hex is parsed and the sidecar rewritten. Sizes and modification times alone
+// can't tell, since a patched image has the size of the original and can be rewritten within the timestamp resolution.
+//
+// Layout, all in native byte order:
+//   Header
+//   linear page numbers[NumPages], sorted
+//   Record[NumRecords]
+//   image bytes, starting on a 64-byte boundary
+//   presence bitmap, one uint64_t per 64 image bytes, starting on an 8-byte boundary
+class HexImage
+{
+public:
+	// Parses the text of a .hex file into a HexFile
+	typedef std::function<void(const std::string &, HexFile &)> Parser;
+
+	static std::string SidecarPath(const std::string &hexPath)
+	{
+		return hexPath + ".img";
+	}
+
+	static void ParseText(const std::string &hexPath, HexFile &hexFile)
+	{
+		std::ifstream hexStream(hexPath, std::ios_base::binary);
+		if (!hexStream.is_open())
+			throw SyscallError("Could not open hex file " + hexPath);
+
+		if (!(hexStream >> hexFile))
+			throw std::runtime_error("Could not load HexFile from " + hexPath);
+	}
+
+	// Loads hexPath from its sidecar if that is up to date, otherwise parses it and writes a new sidecar
+	static void Load(const std::string &hexPath, HexFile &hexFile, const Parser &parse = ParseText)
+	{
+		Source source(hexPath);
+		std::string sidecarPath = SidecarPath(hexPath);
+		if (read(sidecarPath, source, hexFile))
+			return;
+
+		parse(hexPath, hexFile);
+
+		try
+		{
+			write(sidecarPath, source, hexFile);
+		}
+		catch (std::exception &err)
+		{
+			std::cerr << "Warning: " << err.what() << std::endl;
+		}
+	}
+
+	// Re-blocks hexFile for flashing, warning on log about every range that had to be filled in
+	static void Reblock(HexFile &hexFile, const std::string &name, std::ostream &log)
+	{
+		for (const HexFile::Gap &gap : hexFile.Reblock())
+			log << name << ": warning: No data for " << std::hex << gap.Begin << '-' << gap.End - 1 << std::dec <<
+					", filled with 0" << std::endl;
+	}
+
+	// Load() followed by Reblock(), for tools that work on whole flash blocks
+	static void LoadBlocks(const std::string &hexPath, HexFile &hexFile, std::ostream &log, const Parser &parse = ParseText)
+	{
+		Load(hexPath, hexFile, parse);
+		Reblock(hexFile, hexPath, log);
+	}
+
+private:
+	static constexpr char Magic[8] = {'H', 'E', 'X', 'I', 'M', 'G', '\0', '\3'};
+	static constexpr size_t PayloadAlignment = 64;
+
+	struct Source
+	{
+		explicit Source(const std::string &path)
+		{
+			std::ifstream stream(path, std::ios_base::binary);
+			if (!stream.is_open())
+				throw SyscallError("Could not open hex file " + path);
+
+			std::vector<u_char> text = HexParser::ReadAll(stream);
+			if (stream.bad())
+				throw SyscallError("Could not read hex file " + path);
+
+			Size = text.size();
+			Hash = hash(text.data(), text.size());
+		}
+
+		// FNV-1a, eight bytes at a time
+		static uint64_t hash(const u_char *bytes, size_t length)
+		{
+			uint64_t hash = 0xcbf29ce484222325;
+			for (; length >= sizeof(uint64_t); bytes+= sizeof(uint64_t), length-= sizeof(uint64_t))
+			{
+				uint64_t word;
+				memcpy(&word, bytes, sizeof(word));
+				hash = (hash ^ word) * 0x100000001b3;
+			}
+			for (; length > 0; ++bytes, --length)
+				hash = (hash ^ *bytes) * 0x100000001b3;
+			return hash;
+		}
+
+		uint64_t Size;
+		uint64_t Hash;
+	};
+
+	struct Header
+	{
+		char Magic[8];
+		uint64_t SourceSize;
+		uint64_t SourceHash;
+		uint32_t NumPages, NumRecords;
+		uint64_t ImageSize;
+	};
+	static_assert(sizeof(Header) == 40);
+
+	struct Record
+	{
+		static constexpr uint32_t NoData = UINT32_MAX;
+
+		uint16_t Address;
+		uint8_t Length, Type;
+		uint32_t Base, Value;
+		uint32_t DataIndex;		// Into the image, or NoData
+	};
+	static_assert(sizeof(Record) == 16);
+
+	static size_t payloadOffset(const Header &header)
+	{
+		size_t tablesEnd = sizeof(Header) + header.NumPages * sizeof(uint32_t) + header.NumRecords * sizeof(Record);
+		return (tablesEnd + PayloadAlignment - 1) / PayloadAlignment * PayloadAlignment;
+	}
+
+	static size_t presentOffset(const Header &header)
+	{
+		return payloadOffset(header) + (header.ImageSize + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+	}
+
+	static size_t presentWords(const Header &header)
+	{
+		return (header.ImageSize + 63) / 64;
+	}
+
+	static size_t fileSize(const Header &header)
+	{
+		return presentOffset(header) + presentWords(header) * sizeof(uint64_t);
+	}
+
+	class Mapping
+	{
+	public:
+		Mapping(int fd, size_t size) : size(size)
+		{
+			address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (address == MAP_FAILED)
+				throw SyscallError("Could not map sidecar");
+		}
+
+		~Mapping()
+		{
+			munmap(address, size);
+		}
+
+		const u_char *Bytes() const { return static_cast<const u_char *>(address); }
+
+	private:
+		void *address;
+		size_t size;
+	};
+
+	// Checks that the tables of a sidecar that is the right size stay within it: pages sorted and inside the 32-bit
+	// address space, one image page for each, and record data inside the image
+	static bool isValid(const Header &header, const uint32_t *pages, const Record *records)
+	{
+		for (size_t index = 0; index < header.NumPages; ++index)
+			if (pages[index] >= (uint64_t(1) << 32) / HexFile::PageSize || (index > 0 && pages[index] <= pages[index - 1]))
+				return false;
+
+		for (size_t index = 0; index < header.NumRecords; ++index)
+		{
+			const Record &record = records[index];
+			if (record.DataIndex == Record::NoData ? record.Type == 0 && record.Length > 0 :
+					record.DataIndex + (uint64_t)record.Length > header.ImageSize)
+				return false;
+		}
+		return true;
+	}
+
+	// Returns false if the sidecar is missing, stale, damaged or not in this format. The tables and image are copied
+	// out of the mapping rather than used in place: a HexFile owns its image, which patching writes to and copies of
+	// the HexFile duplicate, and the copy is a few memcpy()s of the size of the flash, next to nothing beside parsing.
+	static bool read(const std::string &sidecarPath, const Source &source, HexFile &hexFile)
+	{
+		int fd = open(sidecarPath.c_str(), O_RDONLY);
+		if (fd == -1)
+			return false;
+
+		struct stat status;
+		bool haveStatus = (fstat(fd, &status) == 0 && (size_t)status.st_size >= sizeof(Header));
+		if (!haveStatus)
+		{
+			close(fd);
+			return false;
+		}
+
+		Mapping mapping(fd, status.st_size);
+		close(fd);
+
+		const u_char *bytes = mapping.Bytes();
+		const Header &header = *reinterpret_cast<const Header *>(bytes);
+		if (memcmp(header.Magic, Magic, sizeof(Magic)) != 0 || header.SourceSize != source.Size ||
+				header.SourceHash != source.Hash || header.ImageSize != (uint64_t)header.NumPages * HexFile::PageSize ||
+				fileSize(header) != (size_t)status.st_size)
+			return false;
+
+		const uint32_t *pages = reinterpret_cast<const uint32_t *>(bytes + sizeof(Header));
+		const Record *records = reinterpret_cast<const Record *>(pages + header.NumPages);
+		const u_char *image = bytes + payloadOffset(header);
+		const uint64_t *present = reinterpret_cast<const uint64_t *>(bytes + presentOffset(header));
+		if (!isValid(header, pages, records))
+			return false;
+
+		hexFile.pages.assign(pages, pages + header.NumPages);
+		hexFile.buildPageMap();
+
+		hexFile.image.assign(image, image + header.ImageSize);
+		hexFile.present.assign(present, present + presentWords(header));
+
+		hexFile.records.resize(header.NumRecords);
+		for (size_t index = 0; index < header.NumRecords; ++index)
+		{
+			const Record &stored = records[index];
+			HexFile::Record &record = hexFile.records[index];
+			record.length = stored.Length;
+			record.address = stored.Address;
+			record.type = stored.Type;
+			record.base = stored.Base;
+			record.value = stored.Value;
+			record.data = (stored.DataIndex != Record::NoData) ? hexFile.image.data() + stored.DataIndex : nullptr;
+		}
+
+		hexFile.ResetTracking();
+		return true;
+	}
+
+	// Written to a temporary file first so a concurrent reader never maps a partial sidecar
+	static void write(const std::string &sidecarPath, const Source &source, const HexFile &hexFile)
+	{
+		Header header;
+		memcpy(header.Magic, Magic, sizeof(Magic));
+		header.SourceSize = source.Size;
+		header.SourceHash = source.Hash;
+		header.NumPages = hexFile.pages.size();
+		header.NumRecords = hexFile.records.size();
+		header.ImageSize = hexFile.image.size();
+
+		std::vector<u_char> bytes(fileSize(header), 0);
+		memcpy(bytes.data(), &header, sizeof(header));
+
+		uint32_t *pages = reinterpret_cast<uint32_t *>(bytes.data() + sizeof(Header));
+		std::copy(hexFile.pages.begin(), hexFile.pages.end(), pages);
+
+		Record *records = reinterpret_cast<Record *>(pages + header.NumPages);
+		for (size_t index = 0; index < header.NumRecords; ++index)
+		{
+			const HexFile::Record &record = hexFile.records[index];
+			records[index] = {(uint16_t)record.address, record.length, record.type, record.base, record.value,
+					record.data ? (uint32_t)(record.data - hexFile.image.data()) : Record::NoData};
+		}
+
+		u_char *image = bytes.data() + payloadOffset(header);
+		std::copy(hexFile.image.begin(), hexFile.image.end(), image);
+		memcpy(bytes.data() + presentOffset(header), hexFile.present.data(), hexFile.present.size() * sizeof(uint64_t));
+
+		// A name of its own, so that builds loading the same image at once don't write over each other's file
+		std::string tempPath = sidecarPath + ".XXXXXX";
+		int fd = mkstemp(tempPath.data());
+		if (fd == -1)
+			throw SyscallError("Could not create sidecar " + tempPath);
+
+		try
+		{
+			for (size_t offset = 0; offset < bytes.size(); )
+			{
+				ssize_t written = ::write(fd, bytes.data() + offset, bytes.size() - offset);
+				if (written == -1 && errno != EINTR)
+					throw SyscallError("Could not write sidecar " + tempPath);
+				offset+= std::max<ssize_t>(written, 0);
+			}
+
+			// mkstemp() creates the file readable by its owner only
+			if (fchmod(fd, 0644) != 0)
+				throw SyscallError("Could not set the mode of sidecar " + tempPath);
+
+			if (close(fd) != 0)
+			{
+				fd = -1;
+				throw SyscallError("Could not write sidecar " + tempPath);
+			}
+			fd = -1;
+
+			if (rename(tempPath.c_str(), sidecarPath.c_str()) != 0)
+				throw SyscallError("Could not rename " + tempPath + " to " + sidecarPath);
+		}
+		catch (...)
+		{
+			if (fd != -1)
+				close(fd);
+			unlink(tempPath.c_str());
+			throw;
+		}
+	}
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "Simd.inl"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Parses Intel HEX records straight out of a contiguous buffer. Each line is validated and decoded as a whole, with
+// digits looked up in a table (or converted 16 at a time), and its check byte verified by summing the decoded bytes.
+class HexParser
+{
+public:
+	struct Record
+	{
+		u_char Length;
+		uint16_t Address;
+		u_char Type;
+		const u_char *Data;		// Length bytes, valid until the next call to Next()
+	};
+
+	HexParser(const u_char *begin, const u_char *end) : position(begin), end(end) { }
+
+	// Reads the rest of the stream into one buffer to parse; only sets failbit on a read error. Seekable streams are
+	// sized up front so the buffer is allocated once.
+	static std::vector<u_char> ReadAll(std::istream &is)
+	{
+		std::vector<u_char> text;
+		std::streambuf &buffer = *is.rdbuf();
+		std::streampos start = buffer.pubseekoff(0, std::ios::cur, std::ios::in);
+		std::streampos stop = buffer.pubseekoff(0, std::ios::end, std::ios::in);
+		if (start != std::streampos(-1) && stop != std::streampos(-1) && buffer.pubseekpos(start, std::ios::in) == start)
+			text.reserve(stop - start + 1);
+
+		static const size_t minReadSize = 1 << 16;
+		while (is)
+		{
+			size_t oldSize = text.size();
+			text.resize(oldSize + std::max(text.capacity() - oldSize, minReadSize));
+			is.read(reinterpret_cast<char *>(text.data() + oldSize), text.size() - oldSize);
+			text.resize(oldSize + is.gcount());
+		}
+
+		if (is.eof() && !is.bad())
+			is.clear(std::ios::eofbit);
+		return text;
+	}
+
+	// Parses the next record, returning false if only white space remains
+	bool Next(Record &record)
+	{
+		while (position < end && isspace(*position))
+			++position;
+		if (position == end)
+			return false;
+
+		u_char colon = *position++;
+		if (colon != ':')
+			throw std::runtime_error(std::string("Expected : on input, got ") + (char)colon + '(' + std::to_string((char)colon) + ')');
+
+		// The length byte tells how many digits the rest of the record has
+		size_t numDigits = 2;
+		validateDigits(numDigits);
+		numDigits = (Simd::HexDigitValues[position[0]] << 4 | Simd::HexDigitValues[position[1]]) * 2 + 10;
+		validateDigits(numDigits);
+
+		size_t numBytes = numDigits / 2;
+		Simd::DecodeHexDigits(bytes.data(), position, numBytes);
+		position+= numDigits;
+
+		u_char checkSum = Simd::SumBytes(bytes.data(), numBytes);
+		if (checkSum != 0)
+		{
+			u_char checkByte = bytes[numBytes - 1];
+			throw std::runtime_error(std::string("Invalid check byte ") + std::to_string(checkByte) + " should be " +
+					std::to_string((u_char)(checkByte - checkSum)));
+		}
+
+		record.Length = bytes[0];
+		record.Address = bytes[1] << 8 | bytes[2];
+		record.Type = bytes[3];
+		record.Data = bytes.data() + 4;
+		return true;
+	}
+
+private:
+	void validateDigits(size_t numDigits) const
+	{
+		size_t available = std::min<size_t>(numDigits, end - position);
+		size_t badDigit = Simd::FindNonHexDigit(position, available);
+		if (badDigit != available)
+			throw std::runtime_error(std::string("Expected hex digit, got ") + std::to_string(position[badDigit]));
+		if (available != numDigits)
+			throw std::runtime_error("Expected hex digit, got end of input");
+	}
+
+	const u_char *position, *end;
+	// Length, address, type, up to 255 data bytes and the check byte
+	std::array<u_char, 260> bytes;
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "HexFile.inl"
+
+#include <array>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// A changed copy of a HexFile that shares everything with it except the 64-byte blocks it writes, which are copied on
+// the first write. Any number of variants of one base can be made and written out at once, from any threads, as long
+// as the base is left alone meanwhile and its low sum has been computed beforehand with GetLowSum().
+class HexVariant
+{
+public:
+	static const u_int BlockSize = 64;
+
+	explicit HexVariant(const HexFile &base) : base(base), lowSum(base.GetLowSum()) { }
+
+	void Write(u_int address, const u_char *bytes, size_t length)
+	{
+		for (size_t offset = 0; offset < length; ++offset, ++address)
+		{
+			if (!base.IsPresent(address))
+				throw std::out_of_range(std::string("No record at address ") + std::to_string(address));
+
+			u_char &byte = block(address)[address % BlockSize];
+			if (address >= HexFile::BeginSummed && address < HexFile::EndSummed)
+				lowSum+= bytes[offset] - byte;
+			byte = bytes[offset];
+		}
+	}
+
+	void UpdateLowSum()
+	{
+		const u_char storedSum[2] = {(u_char)(lowSum >> 8), (u_char)lowSum};
+		Write(HexFile::StoredSumAddress, storedSum, sizeof(storedSum));
+	}
+
+	// Data records holding a copied block are formatted from a copy with the block's bytes in place
+	friend std::ostream &operator<<(std::ostream &os, const HexVariant &variant)
+	{
+		size_t size = 0;
+		for (auto &record : variant.base.records)
+			size+= HexWriter::RecordSize(record.PayloadLength());
+
+		std::vector<char> text(size);
+		char *position = text.data();
+		for (auto &record : variant.base.records)
+		{
+			auto copied = variant.blocks.end();
+			if (record.type == 0 && record.length > 0)
+				copied = variant.blocks.lower_bound(record.LinearAddress() / BlockSize);
+
+			if (copied == variant.blocks.end() || copied->first > (record.LinearAddress() + record.length - 1) / BlockSize)
+			{
+				position = formatRecord(position, record);
+				continue;
+			}
+
+			u_char data[0xff];
+			HexFile::Record changed = record;
+			std::copy(record.begin(), record.end(), data);
+			changed.data = data;
+			for (; copied != variant.blocks.end() && copied->first * BlockSize < record.LinearAddress() + record.length;
+					++copied)
+				for (u_int offset = 0; offset < record.length; ++offset)
+					if ((record.LinearAddress() + offset) / BlockSize == copied->first)
+						data[offset] = copied->second[(record.LinearAddress() + offset) % BlockSize];
+
+			position = formatRecord(position, changed);
+		}
+
+		return os.write(text.data(), text.size());
+	}
+
+private:
+	std::array<u_char, BlockSize> &block(u_int address)
+	{
+		auto [copied, isNew] = blocks.try_emplace(address / BlockSize);
+		if (isNew)
+			for (u_int offset = 0; offset < BlockSize; ++offset)
+			{
+				u_int blockAddress = address / BlockSize * BlockSize + offset;
+				copied->second[offset] = base.IsPresent(blockAddress) ? base[blockAddress] : 0;
+			}
+
+		return copied->second;
+	}
+
+	const HexFile &base;
+	std::map<u_int, std::array<u_char, BlockSize>> blocks;		// By block number
+	uint16_t lowSum;
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Sections of a disassembler .hint file:
+// <code|ram|literal|unknown|config|eeprom> <address-start> <address-end> <section_name>
+class Hint
+{
+public:
+	struct Section
+	{
+		std::string Type;
+		u_int Begin, End;	// Inclusive
+		std::string Name;
+
+		bool Contains(u_int address) const { return address >= Begin && address <= End; }
+	};
+
+	Hint(const std::string &path)
+	{
+		std::ifstream hintStream(path);
+		if (!hintStream.is_open())
+			throw std::runtime_error("Could not open " + path);
+
+		std::string line;
+		u_int lineNum = 0;
+		while (std::getline(hintStream, line))
+		{
+			++lineNum;
+			line.erase(std::find(line.begin(), line.end(), '#'), line.end());
+
+			std::istringstream lineStream(line);
+			Section section;
+			if (!(lineStream >> section.Type) || section.Type == "label")
+				continue;
+
+			if (!(lineStream >> std::hex >> section.Begin >> section.End >> section.Name))
+				throw std::runtime_error(path + ':' + std::to_string(lineNum) + ": Expected <type> <start> <end> <name>");
+
+			sections.push_back(section);
+		}
+	}
+
+	// ROM addresses covered by the named sections but by no other ROM section
+	std::vector<u_int> GetExclusiveAddresses(const std::string &name) const
+	{
+		std::vector<u_int> addresses;
+		for (const Section &section : sections)
+		{
+			if (section.Name != name || section.Type == "ram")
+				continue;
+
+			for (u_int address = section.Begin; address <= section.End; ++address)
+			{
+				bool shared = false;
+				for (const Section &other : sections)
+					if (other.Name != name && other.Type != "ram" && other.Contains(address))
+						shared = true;
+
+				if (!shared)
+					addresses.push_back(address);
+			}
+		}
+		return addresses;
+	}
+
+	std::vector<Section> sections;
+};
@@ -0,0 +1,191 @@
+#include "HexFile.inl"
+#include "HexImage.inl"
+#include "USBKeys.inl"
+#include "KeyTable.inl"
+#include "KeyDump.inl"
+#include "Firmware.inl"
+#include "Simd.inl"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <unistd.h>
+
+using namespace std;
+
+static const u_int bytesPerLine = 16;
+
+// Changed bytes from Begin up to End, all inside one flash block
+struct Change
+{
+	u_int Begin, End;
+};
+
+struct ChangedBlock
+{
+	u_int Address, NumBytes;
+	const char *OnlyIn;			// Path of the image that has the block if the other one doesn't, or null
+};
+
+// Runs of differing bytes in one block, found a vector at a time
+static void
+diffBlock(u_int blockAddress, const u_char *oldBlock, const u_char *newBlock, vector<Change> &changes)
+{
+	for (u_int offset = 0; offset < HexFile::FlashBlockSize; )
+	{
+		offset+= Simd::FindDifference(oldBlock + offset, newBlock + offset, HexFile::FlashBlockSize - offset);
+		if (offset == HexFile::FlashBlockSize)
+			break;
+
+		u_int end = offset + 1;
+		while (end < HexFile::FlashBlockSize && oldBlock[end] != newBlock[end])
+			++end;
+		changes.push_back({blockAddress + offset, blockAddress + end});
+		offset = end;
+	}
+}
+
+// keys lines for the table part of a change, a row at most each, and db lines of bytesPerLine for the rest
+static void
+writePatch(ostream &os, const HexFile &newImage, const Change &change, u_int tableBegin, u_int tableEnd)
+{
+	for (u_int address = change.Begin; address < change.End; )
+	{
+		bool inTable = (address >= tableBegin && address < tableEnd);
+		u_int end = min(change.End, inTable ? tableEnd : (address < tableBegin ? tableBegin : change.End));
+		if (inTable)
+			end = min(end, tableBegin + ((address - tableBegin) / KeyTable::KeysPerRow + 1) * KeyTable::KeysPerRow);
+		else
+			end = min(end, address + bytesPerLine);
+
+		os << hex << setw(4) << setfill('0') << address << ':' << (inTable ? "\tkeys" : "\tdb");
+		for (; address < end; ++address)
+			if (inTable)
+				os << '\t' << KeyDump::PatchName(newImage[address]);
+			else
+				os << '\t' << setw(2) << (u_int)newImage[address];
+		os << endl;
+	}
+}
+
+int
+main(int ac, char *av[])
+{
+	bool quiet = false;
+
+	ios_base::sync_with_stdio(false);
+
+	int ch;
+	while ((ch = getopt(ac, av, "q")) != -1)
+		switch (ch)
+		{
+			case 'q':
+				quiet = true;
+				break;
+
+			default:
+				goto usage;
+		}
+
+	ac-= optind;
+	av+= optind - 1;
+
+	if (ac != 2)
+	{
+usage:
+		cerr << "usage: " << getprogname() << " [-q] <old.hex> <new.hex> > <file.patch>" << endl;
+		cerr << "Lists the flash blocks that differ and the scancode table entries that changed, and writes a patch that "
+				"Patch turns old.hex into new.hex with" << endl;
+		cerr << "-q\t\tOnly write the patch" << endl;
+		return 64; // EX_USAGE
+	}
+
+	HexFile oldImage, newImage;
+	HexImage::LoadBlocks(av[1], oldImage, clog);
+	HexImage::LoadBlocks(av[2], newImage, clog);
+
+	u_int tableBegin = KeyTable::DefaultBegin, tableEnd = KeyTable::DefaultEnd;
+	if (const Firmware::Entry *firmware = Firmware::Identify(oldImage))
+	{
+		tableBegin = firmware->TableBegin;
+		tableEnd = firmware->TableEnd;
+	}
+
+	auto start = chrono::steady_clock::now();
+	vector<Change> changes;
+	vector<ChangedBlock> changedBlocks;
+	u_int numOneSided = 0;
+	for (u_int blockAddress = 0; blockAddress < HexFile::FlashEnd; blockAddress+= HexFile::FlashBlockSize)
+	{
+		const u_char *oldBlock = oldImage.GetBlock(blockAddress), *newBlock = newImage.GetBlock(blockAddress);
+		if (!oldBlock && !newBlock)
+			continue;
+
+		if (!oldBlock || !newBlock)
+		{
+			changedBlocks.push_back({blockAddress, HexFile::FlashBlockSize, oldBlock ? av[1] : av[2]});
+			++numOneSided;
+			continue;
+		}
+
+		size_t numChanges = changes.size();
+		diffBlock(blockAddress, oldBlock, newBlock, changes);
+		u_int numBytes = 0;
+		for (size_t index = numChanges; index < changes.size(); ++index)
+			numBytes+= changes[index].End - changes[index].Begin;
+		if (numBytes > 0)
+			changedBlocks.push_back({blockAddress, numBytes, nullptr});
+	}
+	double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	if (!quiet)
+	{
+		for (const ChangedBlock &block : changedBlocks)
+		{
+			clog << "Block " << dec << setw(4) << block.Address / HexFile::FlashBlockSize << " at " << hex << setw(4) <<
+					setfill('0') << block.Address << setfill(' ') << ": ";
+			if (block.OnlyIn)
+				clog << "only in " << block.OnlyIn << endl;
+			else
+				clog << dec << block.NumBytes << " bytes changed" << endl;
+		}
+
+		for (const Change &change : changes)
+			for (u_int address = max(change.Begin, tableBegin); address < min(change.End, tableEnd); ++address)
+				clog << hex << setw(4) << setfill('0') << address << setfill(' ') << ": " <<
+						KeyDump::PatchName(oldImage[address]) << " -> " << KeyDump::PatchName(newImage[address]) << endl;
+
+		clog << "Compared " << dec << HexFile::FlashEnd / HexFile::FlashBlockSize << " blocks in " << elapsed << " ms" << endl;
+	}
+
+	// Runs that carry on into the next block are joined up again, so that table rows stay whole
+	vector<Change> runs;
+	for (const Change &change : changes)
+		if (!runs.empty() && runs.back().End == change.Begin)
+			runs.back().End = change.End;
+		else
+			runs.push_back(change);
+
+	// Patch works the stored low sum out again, so it is left out
+	for (const Change &change : runs)
+		for (u_int address = change.Begin; address < change.End; )
+		{
+			u_int end = address;
+			while (end < change.End && !(end >= HexFile::StoredSumAddress && end < HexFile::StoredSumAddress + 2u))
+				++end;
+			if (end > address)
+				writePatch(cout, newImage, {address, end}, tableBegin, tableEnd);
+			address = max(end, address + 1);
+		}
+
+	// A patch can only change bytes that are there
+	if (numOneSided > 0)
+	{
+		cerr << "error: " << dec << numOneSided << " blocks are in only one of the images, which the patch leaves out" << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "HexFile.inl"
+#include "USBKeys.inl"
+#include "KeyTable.inl"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The scancode table of an image with the names of its keys, in the formats FindKeys writes
+class KeyDump
+{
+public:
+	struct Key
+	{
+		u_int Address;
+		u_char Byte;
+		bool Modifier;				// Stored 0x10 above its HID usage
+		std::string_view Name;		// Empty if the usage has no name
+	};
+
+	// Only the table is looked at; bytes no record supplied are left out
+	KeyDump(const HexFile &hexFile, u_int tableBegin, u_int tableEnd) : tableBegin(tableBegin)
+	{
+		keys.reserve(tableEnd - tableBegin);
+		for (u_int address = tableBegin; address < tableEnd; ++address)
+		{
+			if (!hexFile.IsPresent(address))
+				continue;
+
+			Key key;
+			key.Address = address;
+			key.Byte = hexFile[address];
+			key.Modifier = (key.Byte >= 0xe0);
+
+			key.Name = USBKeys::Name(key.Modifier ? key.Byte - 0x10 : key.Byte);
+			keys.push_back(key);
+		}
+	}
+
+	const std::vector<Key> &GetKeys() const { return keys; }
+
+	// A byte of the table as a patch file names it. The modifiers stored unshifted are left as numbers, since patch
+	// files shift modifiers named.
+	static std::string PatchName(u_char byte)
+	{
+		bool modifier = (byte >= 0xf0 && byte < 0xf8);
+		u_char usage = modifier ? byte - 0x10 : byte;
+		std::string_view name = USBKeys::Name(usage);
+		if (!name.empty() && !(byte >= 0xe0 && byte < 0xe8) && USBKeys::Find(name) == usage)
+			return std::string(name);
+
+		std::ostringstream number;
+		number << "0x" << std::hex << std::setw(2) << std::setfill('0') << (u_int)byte;
+		return number.str();
+	}
+
+	void WriteText(std::ostream &os) const
+	{
+		using namespace std::literals;
+
+		for (const Key &key : keys)
+		{
+			if ((key.Address - tableBegin) % KeyTable::KeysPerRow == 0)
+				os << std::endl << std::hex << std::setw(4) << std::setfill('0') << key.Address << ':';
+
+			char leftDelim = key.Modifier ? '<' : '(', rightDelim = key.Modifier ? '>' : ')';
+			os << ' '
+					<< leftDelim << std::setw(USBKeys::maxKeyNameLength) << std::setfill(' ')
+					<< (key.Name.empty() ? "???"sv : key.Name)
+					<< rightDelim << std::hex << std::setw(2) << std::setfill('0') << (u_int)key.Byte;
+		}
+	}
+
+	// One object per key, with the address and byte in decimal and a null key for unnamed usages
+	void WriteJSON(std::ostream &os) const
+	{
+		os << '[' << std::dec;
+		for (const Key &key : keys)
+		{
+			os << ((&key == keys.data()) ? "\n" : ",\n");
+			os << "{\"address\": " << key.Address << ", \"byte\": " << (u_int)key.Byte << ", \"modifier\": " <<
+					(key.Modifier ? "true" : "false") << ", \"key\": ";
+			if (!key.Name.empty())
+				os << '"' << key.Name << '"';
+			else
+				os << "null";
+			os << '}';
+		}
+		os << "\n]" << std::endl;
+	}
+
+	static const size_t EntrySize = 3 + USBKeys::maxKeyNameLength;
+
+	// Fixed-size little-endian entries: 16-bit address, raw byte, then the key name padded with NULs (all NUL if unnamed)
+	void WriteBinary(std::ostream &os) const
+	{
+		std::vector<char> entries(keys.size() * EntrySize, '\0');
+		char *entry = entries.data();
+		for (const Key &key : keys)
+		{
+			entry[0] = key.Address & 0xff;
+			entry[1] = key.Address >> 8;
+			entry[2] = key.Byte;
+			memcpy(entry + 3, key.Name.data(), std::min(key.Name.size(), USBKeys::maxKeyNameLength));
+			entry+= EntrySize;
+		}
+
+		os.write(entries.data(), entries.size());
+	}
+
+private:
+	u_int tableBegin;
+	std::vector<Key> keys;
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "HexFile.inl"
+#include "USBKeys.inl"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+// Finds the scancode table of a firmware image: a run of rows of KeysPerRow HID usages, with the modifiers stored 0x10
+// above their usages (0xf0 to 0xf7). Every byte is weighted by how likely it is to be in such a table, going by the
+// usages that have names, and every window of the table's length is scored by the sum of its weights plus a bonus for
+// each letter it holds. Window sums are kept running as the window slides, so the whole image is scored in one pass.
+class KeyTable
+{
+public:
+	// Where the table is in the 0x0220 firmware, 19 rows long
+	static const u_int DefaultBegin = 0xbf4, DefaultEnd = 0xc8c;
+	static const u_int KeysPerRow = 8;
+
+	struct Candidate
+	{
+		u_int Begin;
+		int Score;
+	};
+
+	KeyTable()
+	{
+		for (u_int byte = 0; byte < 256; ++byte)
+		{
+			bool isModifier = (byte >= 0xf0 && byte < 0xf8);
+			u_int usage = isModifier ? byte - 0x10 : byte;
+			if (byte >= 0xe0 && byte < 0xe8)
+				weights[byte] = UnshiftedWeight;
+			else if (USBKeys::Name(usage).empty())
+				weights[byte] = UnnamedWeight;
+			else if (byte == 0)
+				weights[byte] = NoneWeight;
+			else if (isModifier || (usage >= 0x04 && usage <= 0x65))
+				weights[byte] = KeyboardWeight;
+			else
+				weights[byte] = OtherWeight;
+		}
+	}
+
+	// The best scoring windows of length bytes below HexFile::FlashEnd that don't overlap each other, best first
+	std::vector<Candidate> Locate(const HexFile &hexFile, size_t maxCandidates,
+			u_int length = DefaultEnd - DefaultBegin) const
+	{
+		std::vector<int> byteWeights(HexFile::FlashEnd);
+		std::vector<signed char> letters(HexFile::FlashEnd, -1);
+		for (u_int address = 0; address < HexFile::FlashEnd; ++address)
+		{
+			if (!hexFile.IsPresent(address))
+			{
+				byteWeights[address] = AbsentWeight;
+				continue;
+			}
+
+			u_char byte = hexFile[address];
+			byteWeights[address] = weights[byte];
+			if (byte >= FirstLetter && byte < FirstLetter + NumLetters)
+				letters[address] = byte - FirstLetter;
+		}
+
+		std::vector<Candidate> scored;
+		if (length == 0 || length > HexFile::FlashEnd)
+			return scored;
+
+		scored.reserve(HexFile::FlashEnd - length + 1);
+		std::array<u_int, NumLetters> letterCounts{};
+		int weightSum = 0;
+		u_int numLetters = 0;
+		for (u_int address = 0; address < HexFile::FlashEnd; ++address)
+		{
+			weightSum+= byteWeights[address];
+			if (letters[address] >= 0 && letterCounts[letters[address]]++ == 0)
+				++numLetters;
+
+			if (address < length - 1)
+				continue;
+
+			u_int begin = address + 1 - length;
+			scored.push_back({begin, weightSum + (int)numLetters * LetterBonus});
+
+			weightSum-= byteWeights[begin];
+			if (letters[begin] >= 0 && --letterCounts[letters[begin]] == 0)
+				--numLetters;
+		}
+
+		std::stable_sort(scored.begin(), scored.end(),
+				[](const Candidate &a, const Candidate &b) { return a.Score > b.Score; });
+
+		std::vector<Candidate> candidates;
+		for (const Candidate &candidate : scored)
+		{
+			if (candidates.size() == maxCandidates)
+				break;
+
+			bool overlaps = std::any_of(candidates.begin(), candidates.end(), [&](const Candidate &chosen)
+					{
+						return candidate.Begin < chosen.Begin + length && chosen.Begin < candidate.Begin + length;
+					});
+			if (!overlaps)
+				candidates.push_back(candidate);
+		}
+
+		return candidates;
+	}
+
+private:
+	// Keyboard keys, shifted modifiers and unassigned positions (0) are what a table is made of
+	static const int KeyboardWeight = 2, NoneWeight = 2, OtherWeight = 0;
+	// Modifiers not shifted, usages without names and bytes missing from the image rule a window out quickly
+	static const int UnshiftedWeight = -4, UnnamedWeight = -4, AbsentWeight = -64;
+	// A table holds every letter once, which sets it apart from runs of zeros
+	static const u_char FirstLetter = 0x04, NumLetters = 26;
+	static const int LetterBonus = 8;
+
+	std::array<int, 256> weights;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "Simd.inl"
+#include "ThreadPool.inl"
+
+#include <sys/types.h>
+#include <array>
+#include <algorithm>
+
+// The .irrxfw obfuscation XORs each byte with ~a[position % 83] ^ b[round % 0x35], where the round counter starts at
+// 0x11 and advances every 83 bytes. The key therefore only depends on the position and repeats every 83 * 0x35 bytes,
+// so the whole period is generated at compile time and then XORed over entire buffers.
+namespace KeystreamGenerator
+{
+	static constexpr size_t ALength = 83, BLength = 0x35;
+	static constexpr size_t Period = ALength * BLength;
+	static constexpr u_int FirstRound = 0x11;
+
+	static constexpr u_char a[ALength] =
+	{
+		0x31, 0x1c, 0xef, 0x62, 0xdf, 0xa7, 0x43, 0x23, 0x78, 0x92, 0x22, 0x6a,
+		0x38, 0x12, 0x14, 0xa4, 0x65, 0x02, 0x2b, 0x00, 0x9c, 0x00, 0x57, 0x5e,
+		0x10, 0x85, 0x50, 0x73, 0xd0, 0xb1, 0x17, 0x2b, 0x49, 0xac, 0x49, 0xc4,
+		0x33, 0x21, 0xb4, 0x48, 0x23, 0x8c, 0x27, 0x98, 0x12, 0x34, 0x80, 0x00,
+		0x48, 0xff, 0xb4, 0x8f, 0x04, 0x2e, 0x24, 0x2d, 0x92, 0xc7, 0x82, 0xe2,
+		0xa6, 0xa5, 0x20, 0x20, 0x98, 0x11, 0x84, 0x26, 0xb7, 0xcc, 0x28, 0xf3,
+		0xe6, 0x98, 0x38, 0x23, 0xdc, 0xba, 0x28, 0x44, 0x42, 0x39, 0x44,
+	}, b[BLength] =
+	{
+		0x12, 0x14, 0xa4, 0x65, 0x02, 0x2b, 0x00, 0x9c, 0x00, 0x57, 0x5e, 0x10,
+		0x85, 0x50, 0x73, 0xd0, 0xb1, 0x17, 0x2b, 0x49, 0xac, 0x49, 0xc4, 0x33,
+		0x21, 0xb4, 0x48, 0x23, 0x8c, 0x27, 0x98, 0x12, 0x34, 0x80, 0x00, 0x48,
+		0xff, 0xb4, 0x8f, 0x04, 0x2e, 0x24, 0x2d, 0x92, 0xc7, 0x82, 0xe2, 0xa6,
+		0xa5, 0x20, 0x20, 0x98, 0x11,
+	};
+
+	static constexpr std::array<u_char, Period> MakeTable()
+	{
+		std::array<u_char, Period> table{};
+		for (size_t index = 0; index < Period; ++index)
+			table[index] = ~a[index % ALength] ^ b[(FirstRound + index / ALength) % BLength];
+		return table;
+	}
+
+	// The round number exactly as Apple's updater reduces it, using a multiply instead of dividing by 0x35
+	static constexpr u_int ReferenceRound(u_int round)
+	{
+		u_int quotient = ((uint64_t)round * 0x3521cfb3) >> 32;
+		quotient = (quotient + ((round - quotient) >> 1)) >> 5;
+		return round - quotient * 0x35;
+	}
+
+	// Byte-at-a-time key exactly as computed by Apple's updater
+	static constexpr u_char ReferenceKey(size_t position)
+	{
+		return ~a[position % ALength] ^ b[ReferenceRound(FirstRound + position / ALength)];
+	}
+
+	static constexpr bool BIsWindowOfA()
+	{
+		for (size_t index = 0; index < BLength; ++index)
+			if (b[index] != a[13 + index])
+				return false;
+		return true;
+	}
+
+	static constexpr bool ReferenceRoundMatches(size_t maxImageSize)
+	{
+		for (u_int round = FirstRound; round <= FirstRound + maxImageSize / ALength; ++round)
+			if (ReferenceRound(round) != round % BLength)
+				return false;
+		return true;
+	}
+
+	static constexpr bool TableMatchesReference(const std::array<u_char, Period> &table)
+	{
+		for (size_t position = 0; position < Period; ++position)
+			if (table[position] != ReferenceKey(position))
+				return false;
+		return true;
+	}
+
+	static constexpr bool RepeatsEvery(const std::array<u_char, Period> &table, size_t shortPeriod)
+	{
+		for (size_t index = shortPeriod; index < Period; ++index)
+			if (table[index] != table[index - shortPeriod])
+				return false;
+		return true;
+	}
+};
+
+class Keystream
+{
+public:
+	static constexpr size_t ALength = KeystreamGenerator::ALength, BLength = KeystreamGenerator::BLength;
+	static constexpr size_t Period = KeystreamGenerator::Period;
+	static constexpr u_int FirstRound = KeystreamGenerator::FirstRound;
+
+	// Byte sums of the decoded and encoded kbd_0x0069_0x0220 images
+	static constexpr u_int ExpectedPlainSum = 0x1057f8, ExpectedCodedSum = 0x252ed7;
+
+	static constexpr std::array<u_char, Period> Table = KeystreamGenerator::MakeTable();
+
+	static constexpr u_char Key(size_t position)
+	{
+		return Table[position % Period];
+	}
+
+	// Encoding and decoding are the same operation; position is the offset of in[0] within the image
+	static void Apply(u_char *out, const u_char *in, size_t length, size_t position = 0, bool useSimd = true)
+	{
+		size_t index = position % Period;
+		while (length > 0)
+		{
+			size_t runLength = std::min(length, Period - index);
+			if (useSimd)
+				Simd::XorBytes(out, in, Table.data() + index, runLength);
+			else
+				Simd::XorBytesScalar(out, in, Table.data() + index, runLength);
+
+			out+= runLength;
+			in+= runLength;
+			length-= runLength;
+			index = 0;
+		}
+	}
+
+	// Same as Apply(), but split into chunks that are coded concurrently. Since every chunk is coded at its own
+	// position the output is identical to the serial path.
+	static void Apply(ThreadPool &pool, u_char *out, const u_char *in, size_t length, size_t position = 0,
+			bool useSimd = true, size_t chunkSize = DefaultChunkSize)
+	{
+		size_t numChunks = (length + chunkSize - 1) / chunkSize;
+		pool.Run(numChunks, [&](size_t chunkIndex)
+		{
+			size_t chunkOffset = chunkIndex * chunkSize;
+			Apply(out + chunkOffset, in + chunkOffset, std::min(chunkSize, length - chunkOffset), position + chunkOffset,
+					useSimd);
+		});
+	}
+
+	static constexpr size_t DefaultChunkSize = Period * 64;
+
+	static constexpr u_char ReferenceKey(size_t position)
+	{
+		return KeystreamGenerator::ReferenceKey(position);
+	}
+
+	// An image is plain Intel HEX if it starts with ':', which never survives encoding
+	static constexpr bool IsCoded(u_char firstByte)
+	{
+		return firstByte != ':';
+	}
+};
+
+static_assert(KeystreamGenerator::BIsWindowOfA(), "b[] should be a[13...65]");
+static_assert(KeystreamGenerator::ReferenceRoundMatches(1 << 20), "Multiply-shift reduction should equal round % 0x35");
+static_assert(KeystreamGenerator::TableMatchesReference(Keystream::Table), "Keystream table should match the per-byte reference");
+static_assert(!KeystreamGenerator::RepeatsEvery(Keystream::Table, Keystream::ALength) &&
+		!KeystreamGenerator::RepeatsEvery(Keystream::Table, Keystream::BLength), "Keystream period should be exactly 83 * 0x35");
+static_assert(Keystream::IsCoded(':' ^ Keystream::Table[0]), "Encoded images should not start with ':'");
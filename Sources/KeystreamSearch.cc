@@ -0,0 +1,408 @@
+#include "Simd.inl"
+#include "ThreadPool.inl"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <numeric>
+
+using namespace std;
+
+// Known-plaintext search for firmware images obfuscated the same way as kbd_0x0069_0x0220.irrxfw, where
+// cipher[p] = plain[p] ^ ~a[p % A] ^ b[(round + p / A) % B]. Writing x = ~a and y[j] = b[(round + j) % B], every byte
+// whose plaintext is known gives one equation x[p % A] ^ y[(p / A) % B] = cipher[p] ^ plain[p]. For each guess of the
+// table lengths and the Intel HEX line layout those equations are solved with a union-find that tracks the XOR
+// distance to each component root, which rejects most guesses as soon as two equations contradict each other.
+
+struct Range
+{
+	u_int Min, Max;
+};
+
+static Range
+parseRange(const char *arg)
+{
+	string str(arg);
+	size_t dash = str.find('-');
+	if (dash == string::npos)
+	{
+		u_int value = stoul(str, nullptr, 0);
+		return {value, value};
+	}
+	return {(u_int)stoul(str.substr(0, dash), nullptr, 0), (u_int)stoul(str.substr(dash + 1), nullptr, 0)};
+}
+
+struct Hypothesis
+{
+	u_int ALength, BLength;
+	u_int LineLength, HeaderLength;
+};
+
+struct Candidate
+{
+	Hypothesis Guess;
+	vector<u_char> X, Y;		// ~a[] and b[] rotated by the starting round
+	u_int ValidRecords, TotalRecords;
+	size_t ValidPrefix;			// Number of leading bytes that decode as well-formed Intel HEX
+};
+
+// Union-find over the A + B unknown table entries, where distance[node] is node ^ parent
+class XorUnionFind
+{
+public:
+	XorUnionFind(size_t numNodes) : parent(numNodes), distance(numNodes, 0), numComponents(numNodes)
+	{
+		iota(parent.begin(), parent.end(), 0);
+	}
+
+	// Record node1 ^ node2 == value, return false if that contradicts what is already known
+	bool Join(u_int node1, u_int node2, u_char value)
+	{
+		u_char distance1, distance2;
+		u_int root1 = Find(node1, distance1), root2 = Find(node2, distance2);
+		if (root1 == root2)
+			return (distance1 ^ distance2) == value;
+
+		parent[root1] = root2;
+		distance[root1] = distance1 ^ distance2 ^ value;
+		--numComponents;
+		return true;
+	}
+
+	u_int Find(u_int node, u_char &distanceToRoot)
+	{
+		u_char total = 0;
+		u_int root = node;
+		while (parent[root] != root)
+		{
+			total^= distance[root];
+			root = parent[root];
+		}
+
+		// Compress the path
+		u_char remaining = total;
+		while (parent[node] != root)
+		{
+			u_int next = parent[node];
+			u_char step = distance[node];
+			parent[node] = root;
+			distance[node] = remaining;
+			remaining^= step;
+			node = next;
+		}
+
+		distanceToRoot = total;
+		return root;
+	}
+
+	size_t GetNumComponents() const { return numComponents; }
+
+private:
+	vector<u_int> parent;
+	vector<u_char> distance;
+	size_t numComponents;
+};
+
+struct KnownByte
+{
+	size_t Position;
+	u_char Value;
+};
+
+static vector<KnownByte>
+knownBytes(const Hypothesis &guess, size_t imageSize, const string &knownPrefix, const string &recordLength,
+		u_int tailLines)
+{
+	vector<KnownByte> known;
+	for (size_t position = 0; position < knownPrefix.size() && position < imageSize; ++position)
+		known.push_back({position, (u_char)knownPrefix[position]});
+
+	if (imageSize < guess.HeaderLength)
+		return known;
+
+	size_t numLines = (imageSize - guess.HeaderLength) / guess.LineLength;
+	numLines = (numLines > tailLines) ? numLines - tailLines : 0;
+	for (size_t line = 0; line < numLines; ++line)
+	{
+		size_t start = guess.HeaderLength + line * guess.LineLength;
+		known.push_back({start, ':'});
+		known.push_back({start + guess.LineLength - 2, '\r'});
+		known.push_back({start + guess.LineLength - 1, '\n'});
+		if (!recordLength.empty())
+		{
+			known.push_back({start + 1, (u_char)recordLength[0]});
+			known.push_back({start + 2, (u_char)recordLength[1]});
+			known.push_back({start + 7, '0'});
+			known.push_back({start + 8, '0'});
+		}
+	}
+
+	return known;
+}
+
+static u_char
+hexValue(u_char high, u_char low)
+{
+	auto nybble = [](u_char ch) { return (ch <= '9') ? ch - '0' : (ch | 0x20) - 'a' + 10; };
+	return nybble(high) << 4 | nybble(low);
+}
+
+// Count the lines of the decoded image that are well-formed records with a valid check byte
+static void
+validate(const vector<u_char> &plain, Candidate &candidate)
+{
+	candidate.ValidRecords = 0;
+	candidate.TotalRecords = 0;
+	candidate.ValidPrefix = 0;
+
+	bool prefixValid = true;
+	size_t lineStart = 0;
+	while (lineStart < plain.size())
+	{
+		auto lineEnd = find(plain.begin() + lineStart, plain.end(), '\n');
+		size_t lineLength = lineEnd - plain.begin() - lineStart;
+		++candidate.TotalRecords;
+
+		const u_char *line = plain.data() + lineStart;
+		// ':', length, address, type, data, check byte, CR
+		bool valid = (lineLength >= 12 && lineLength % 2 == 0 && line[0] == ':' && line[lineLength - 1] == '\r');
+		if (valid)
+		{
+			size_t numDigits = lineLength - 2;
+			valid = (Simd::FindNonHexDigit(line + 1, numDigits) == numDigits);
+		}
+		if (valid)
+		{
+			u_char sum = 0;
+			for (size_t digit = 1; digit < lineLength - 1; digit+= 2)
+				sum+= hexValue(line[digit], line[digit + 1]);
+			valid = (sum == 0 && hexValue(line[1], line[2]) * 2u + 12 == lineLength);
+		}
+
+		if (valid)
+		{
+			++candidate.ValidRecords;
+			if (prefixValid)
+				candidate.ValidPrefix = lineStart + lineLength + 1;
+		}
+		else
+			prefixValid = false;
+
+		lineStart+= lineLength + 1;
+	}
+}
+
+static bool
+solve(const vector<u_char> &cipher, const Hypothesis &guess, const vector<KnownByte> &known, Candidate &candidate)
+{
+	const u_int a = guess.ALength, b = guess.BLength;
+	XorUnionFind unknowns(a + b);
+
+	for (const KnownByte &knownByte : known)
+		if (!unknowns.Join(knownByte.Position % a, a + (knownByte.Position / a) % b,
+				cipher[knownByte.Position] ^ knownByte.Value))
+			return false;
+
+	// Every table entry must be tied to the others, otherwise some keystream bytes are unknown
+	if (unknowns.GetNumComponents() != 1)
+		return false;
+
+	candidate.Guess = guess;
+	candidate.X.resize(a);
+	candidate.Y.resize(b);
+	for (u_int node = 0; node < a + b; ++node)
+	{
+		u_char distance;
+		unknowns.Find(node, distance);
+		(node < a ? candidate.X[node] : candidate.Y[node - a]) = distance;
+	}
+
+	// Decode the image with the recovered tables, one row of A bytes at a time
+	vector<u_char> plain(cipher.size()), row(a);
+	for (size_t rowStart = 0; rowStart < cipher.size(); rowStart+= a)
+	{
+		u_char yByte = candidate.Y[(rowStart / a) % b];
+		for (u_int i = 0; i < a; ++i)
+			row[i] = candidate.X[i] ^ yByte;
+		Simd::XorBytes(plain.data() + rowStart, cipher.data() + rowStart, row.data(), min<size_t>(a, cipher.size() - rowStart));
+	}
+
+	validate(plain, candidate);
+	return candidate.ValidRecords > 0;
+}
+
+// a[] and b[] are only determined up to a common XOR constant, and b[] only up to the starting round. If b[] is a window
+// into a[], as it is for kbd_0x0069_0x0220, find the rotation that lines it up, which recovers the starting round.
+static bool
+findRound(const Candidate &candidate, u_int &round, u_int &windowStart)
+{
+	const u_int a = candidate.Guess.ALength, b = candidate.Guess.BLength;
+	for (round = 0; round < b; ++round)
+		for (windowStart = 0; windowStart + b <= a; ++windowStart)
+		{
+			bool matches = true;
+			for (u_int i = 0; i < b && matches; ++i)
+				matches = (candidate.Y[(i + b - round) % b] == (u_char)~candidate.X[windowStart + i]);
+			if (matches)
+				return true;
+		}
+
+	return false;
+}
+
+static void
+printTable(ostream &os, const char *name, const vector<u_char> &table)
+{
+	os << "\t" << name << "[] =\n\t{";
+	for (size_t index = 0; index < table.size(); ++index)
+		os << ((index % 12 == 0) ? "\n\t\t" : " ") << "0x" << hex << setw(2) << setfill('0') << (u_int)table[index] << ',';
+	os << dec << "\n\t}";
+}
+
+int
+main(int ac, char *av[])
+{
+	Range aRange{2, 128}, bRange{2, 128}, lineRange{141, 141}, headerRange{0, 0};
+	unsigned numThreads = 0;
+	string knownPrefix, recordLength;
+	u_int tailLines = 4;
+	size_t maxResults = 5;
+
+	int ch;
+	while ((ch = getopt(ac, av, "a:b:H:j:k:l:n:r:t:")) != -1)
+		switch (ch)
+		{
+			case 'a': aRange = parseRange(optarg); break;
+			case 'b': bRange = parseRange(optarg); break;
+			case 'H': headerRange = parseRange(optarg); break;
+			case 'j': numThreads = stoul(optarg); break;
+			case 'l': lineRange = parseRange(optarg); break;
+			case 'n': maxResults = stoul(optarg); break;
+			case 't': tailLines = stoul(optarg); break;
+
+			case 'k':
+			{
+				ifstream knownStream(optarg, ios_base::binary);
+				if (!knownStream.is_open())
+					throw runtime_error("Could not open "s + optarg);
+				knownPrefix.assign(istreambuf_iterator<char>(knownStream), istreambuf_iterator<char>());
+				break;
+			}
+
+			case 'r':
+				recordLength = optarg;
+				for (auto &digit : recordLength)
+					digit = toupper(digit);
+				if (recordLength.size() != 2 || !Simd::IsHexDigit(recordLength[0]) || !Simd::IsHexDigit(recordLength[1]))
+				{
+					cerr << "Record length should be two hex digits" << endl;
+					return 64; // EX_USAGE
+				}
+				break;
+
+			default:
+				cerr << "usage: " << av[0] << " [-a <a-lengths>] [-b <b-lengths>] [-l <line-lengths>] [-H <header-lengths>]" << endl;
+				cerr << "       [-r <record-length>] [-k <known-prefix>] [-t <tail-lines>] [-j <threads>] [-n <results>] < <image>" << endl;
+				cerr << "Lengths are a number or an inclusive range like 2-128" << endl;
+				cerr << "-a, -b\t\tLengths of the a[] and b[] tables to try (default 2-128)" << endl;
+				cerr << "-l\t\tLengths of the data record lines, including CR/LF (default 141, i.e. 64 bytes per record)" << endl;
+				cerr << "-H\t\tNumber of bytes before the first data record line (default 0)" << endl;
+				cerr << "-r\t\tRecord length of the data records in hex, also assumes record type 00" << endl;
+				cerr << "-k\t\tFile whose contents are the known start of the decoded image" << endl;
+				cerr << "-t\t\tNumber of trailing lines that may not be data records (default 4)" << endl;
+				cerr << "-j\t\tNumber of threads (default one per CPU)" << endl;
+				cerr << "-n\t\tNumber of candidates to print (default 5)" << endl;
+				return 64; // EX_USAGE
+		}
+
+	ios_base::sync_with_stdio(false);
+	freopen(NULL, "rb", stdin);
+
+	const vector<u_char> cipher((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+	if (cipher.empty())
+		throw runtime_error("Empty input");
+
+	vector<Hypothesis> layouts;
+	for (u_int lineLength = max(lineRange.Min, 13u); lineLength <= lineRange.Max; ++lineLength)
+		for (u_int headerLength = headerRange.Min; headerLength <= headerRange.Max; ++headerLength)
+			layouts.push_back({0, 0, lineLength, headerLength});
+
+	const size_t aCount = aRange.Max - aRange.Min + 1, bCount = bRange.Max - bRange.Min + 1;
+	const size_t numGuesses = layouts.size() * aCount * bCount;
+	clog << "Trying " << numGuesses << " hypotheses over " << cipher.size() << " bytes" << endl;
+
+	mutex resultsMutex;
+	vector<Candidate> results;
+	size_t numRejected = 0;
+
+	ThreadPool pool(numThreads);
+	pool.Run(layouts.size() * aCount, [&](size_t taskIndex)
+	{
+		Hypothesis guess = layouts[taskIndex / aCount];
+		guess.ALength = aRange.Min + taskIndex % aCount;
+		const vector<KnownByte> known = knownBytes(guess, cipher.size(), knownPrefix, recordLength, tailLines);
+
+		size_t rejected = 0;
+		vector<Candidate> found;
+		for (guess.BLength = bRange.Min; guess.BLength <= bRange.Max; ++guess.BLength)
+		{
+			Candidate candidate;
+			if (solve(cipher, guess, known, candidate))
+				found.push_back(move(candidate));
+			else
+				++rejected;
+		}
+
+		lock_guard<mutex> lock(resultsMutex);
+		numRejected+= rejected;
+		for (auto &candidate : found)
+			results.push_back(move(candidate));
+	});
+
+	clog << "Rejected " << numRejected << " hypotheses, " << results.size() << " candidates remain" << endl;
+
+	sort(results.begin(), results.end(), [](const Candidate &lhs, const Candidate &rhs)
+	{
+		if (lhs.ValidPrefix != rhs.ValidPrefix)
+			return lhs.ValidPrefix > rhs.ValidPrefix;
+		if (lhs.ValidRecords != rhs.ValidRecords)
+			return lhs.ValidRecords > rhs.ValidRecords;
+		return lhs.Guess.ALength * lhs.Guess.BLength < rhs.Guess.ALength * rhs.Guess.BLength;
+	});
+
+	for (size_t resultIndex = 0; resultIndex < results.size() && resultIndex < maxResults; ++resultIndex)
+	{
+		const Candidate &candidate = results[resultIndex];
+		const Hypothesis &guess = candidate.Guess;
+		cout << "A = " << guess.ALength << ", B = " << guess.BLength << ", line length " << guess.LineLength
+				<< ", header " << guess.HeaderLength << ": " << candidate.ValidRecords << '/' << candidate.TotalRecords
+				<< " records valid, first " << candidate.ValidPrefix << " of " << cipher.size() << " bytes decode cleanly" << endl;
+
+		vector<u_char> a(guess.ALength), b(guess.BLength);
+		u_int round = 0, windowStart;
+		if (findRound(candidate, round, windowStart))
+			cout << "b[] is a[" << windowStart << "..." << windowStart + guess.BLength - 1 << "], starting round "
+					<< "0x" << hex << round << dec << endl;
+		else
+			cout << "b[] is not a window of a[], so the starting round is unknown; assuming 0" << endl;
+
+		for (u_int i = 0; i < guess.ALength; ++i)
+			a[i] = ~candidate.X[i];
+		for (u_int i = 0; i < guess.BLength; ++i)
+			b[(i + round) % guess.BLength] = candidate.Y[i];
+
+		cout << "static const u_char\n";
+		printTable(cout, "a", a);
+		cout << ",\n";
+		printTable(cout, "b", b);
+		cout << ";\n" << endl;
+	}
+
+	return results.empty() ? 1 : 0;
+}
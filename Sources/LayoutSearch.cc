@@ -0,0 +1,472 @@
+#include "HexFile.inl"
+#include "HexImage.inl"
+#include "USBKeys.inl"
+#include "KeyTable.inl"
+#include "Firmware.inl"
+#include "KeyDump.inl"
+#include "Simd.inl"
+#include "ThreadPool.inl"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <array>
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <unistd.h>
+
+using namespace std;
+
+// The keys that are moved around, where they are on the QWERTY keyboard: rows from the top letter row down, columns
+// from the left little finger's
+struct KeyPosition
+{
+	string_view Name;
+	int Row, Column;
+};
+
+static constexpr KeyPosition qwertyPositions[] =
+{
+	{"Q", 0, 0}, {"W", 0, 1}, {"E", 0, 2}, {"R", 0, 3}, {"T", 0, 4},
+	{"Y", 0, 5}, {"U", 0, 6}, {"I", 0, 7}, {"O", 0, 8}, {"P", 0, 9},
+	{"A", 1, 0}, {"S", 1, 1}, {"D", 1, 2}, {"F", 1, 3}, {"G", 1, 4},
+	{"H", 1, 5}, {"J", 1, 6}, {"K", 1, 7}, {"L", 1, 8}, {"Semicol", 1, 9}, {"Apostro", 1, 10},
+	{"Z", 2, 0}, {"X", 2, 1}, {"C", 2, 2}, {"V", 2, 3}, {"B", 2, 4},
+	{"N", 2, 5}, {"M", 2, 6}, {"Comma", 2, 7}, {"Dot", 2, 8}, {"Slash", 2, 9},
+};
+
+static constexpr size_t numSearchedKeys = size(qwertyPositions);
+
+// Arrays are padded to a whole number of vectors with a key that is never typed and a slot that costs nothing
+static constexpr size_t NumKeys = 32;
+static_assert(numSearchedKeys <= NumKeys, "Too many keys to search");
+
+static constexpr u_char NoKey = 0xff;
+
+// Typing cost of a layout, from how often each key and each pair of keys is typed in a corpus. Slots are numbered as
+// the keys of qwertyPositions, so slot s is where key s is on QWERTY.
+class CostModel
+{
+public:
+	struct Weights
+	{
+		float Travel = 1;			// Per key width a finger moves from its home key
+		float SameFinger = 4;		// Per pair of keys typed in turn with one finger, plus Travel for the distance between them
+		float SameHand = 0.5;		// Per pair of keys typed in turn with one hand
+	};
+
+	CostModel(const Weights &weights)
+	{
+		for (size_t slot = 0; slot < numSearchedKeys; ++slot)
+			travel[slot] = weights.Travel * distance(slot, homeSlot(finger(slot)));
+
+		for (size_t slot1 = 0; slot1 < numSearchedKeys; ++slot1)
+			for (size_t slot2 = 0; slot2 < numSearchedKeys; ++slot2)
+			{
+				if (slot1 == slot2)
+					continue;
+
+				float cost = 0;
+				if (finger(slot1) == finger(slot2))
+					cost+= weights.SameFinger + weights.Travel * distance(slot1, slot2);
+				if ((finger(slot1) < 4) == (finger(slot2) < 4))
+					cost+= weights.SameHand;
+				pairCosts[slot1][slot2] = cost;
+			}
+	}
+
+	// Keys typed one after another; NoKey for anything else, which breaks the sequence
+	void AddKey(u_char key)
+	{
+		if (key != NoKey)
+		{
+			++frequencies[key];
+			++numKeystrokes;
+			if (previousKey != NoKey && previousKey != key)
+			{
+				++pairFrequencies[previousKey][key];
+				++pairFrequencies[key][previousKey];
+			}
+		}
+		previousKey = key;
+	}
+
+	size_t GetNumKeystrokes() const { return numKeystrokes; }
+
+	float GetSlotCost(size_t slot) const { return travel[slot]; }
+	float GetPairCost(size_t slot1, size_t slot2) const { return pairCosts[slot1][slot2]; }
+	float GetFrequency(size_t key) const { return frequencies[key]; }
+	const float *GetPairFrequencies(size_t key) const { return pairFrequencies[key].data(); }
+
+	float Cost(const array<u_char, NumKeys> &slotOf) const
+	{
+		float cost = 0;
+		for (size_t key = 0; key < numSearchedKeys; ++key)
+		{
+			cost+= frequencies[key] * travel[slotOf[key]];
+			for (size_t otherKey = key + 1; otherKey < numSearchedKeys; ++otherKey)
+				cost+= pairFrequencies[key][otherKey] * pairCosts[slotOf[key]][slotOf[otherKey]];
+		}
+
+		return cost;
+	}
+
+private:
+	static constexpr float rowStagger[] = {0, 0.25, 0.75};
+
+	// Little, ring, middle and index fingers of the left hand, then index to little of the right
+	static int finger(size_t slot)
+	{
+		static constexpr int columnFingers[] = {0, 1, 2, 3, 3, 4, 4, 5, 6, 7, 7};
+		return columnFingers[qwertyPositions[slot].Column];
+	}
+
+	static size_t homeSlot(int finger)
+	{
+		static constexpr int homeColumns[] = {0, 1, 2, 3, 6, 7, 8, 9};
+		for (size_t slot = 0; slot < numSearchedKeys; ++slot)
+			if (qwertyPositions[slot].Row == 1 && qwertyPositions[slot].Column == homeColumns[finger])
+				return slot;
+
+		throw logic_error("No home key for finger " + to_string(finger));
+	}
+
+	static float distance(size_t slot1, size_t slot2)
+	{
+		const KeyPosition &position1 = qwertyPositions[slot1], &position2 = qwertyPositions[slot2];
+		float dx = (position1.Column + rowStagger[position1.Row]) - (position2.Column + rowStagger[position2.Row]);
+		float dy = position1.Row - position2.Row;
+		return sqrt(dx * dx + dy * dy);
+	}
+
+	array<float, NumKeys> travel{};
+	array<array<float, NumKeys>, NumKeys> pairCosts{};
+	array<float, NumKeys> frequencies{};
+	array<array<float, NumKeys>, NumKeys> pairFrequencies{};		// Both orders, so symmetric
+	size_t numKeystrokes = 0;
+	u_char previousKey = NoKey;
+};
+
+// One simulated annealing chain of swaps of two keys. costTo[slot][key] is the pair cost of a key in slot next to key
+// where it is now, so that the change in cost of a swap is one vector pass over the keys, and accepting it swaps two
+// columns.
+class LayoutAnnealer
+{
+public:
+	LayoutAnnealer(const CostModel &model, uint64_t seed) : model(model), random(seed)
+	{
+		for (size_t key = 0; key < NumKeys; ++key)
+			slotOf[key] = key;
+		for (size_t slot = 0; slot < NumKeys; ++slot)
+			for (size_t key = 0; key < NumKeys; ++key)
+				costTo[slot][key] = model.GetPairCost(slot, key);
+
+		cost = model.Cost(slotOf);
+		bestSlotOf = slotOf;
+		bestCost = cost;
+	}
+
+	float SwapDelta(size_t key1, size_t key2) const
+	{
+		size_t slot1 = slotOf[key1], slot2 = slotOf[key2];
+		float delta = (model.GetFrequency(key1) - model.GetFrequency(key2)) *
+				(model.GetSlotCost(slot2) - model.GetSlotCost(slot1));
+
+		// Over every key, then without the pair's own terms, which a swap leaves as they are
+		const float *pairs1 = model.GetPairFrequencies(key1), *pairs2 = model.GetPairFrequencies(key2);
+		delta+= Simd::DotOfDifferences(pairs1, pairs2, costTo[slot2].data(), costTo[slot1].data(), NumKeys);
+		for (size_t key : {key1, key2})
+			delta-= (pairs1[key] - pairs2[key]) * (costTo[slot2][key] - costTo[slot1][key]);
+
+		return delta;
+	}
+
+	void Swap(size_t key1, size_t key2)
+	{
+		swap(slotOf[key1], slotOf[key2]);
+		for (auto &costs : costTo)
+			swap(costs[key1], costs[key2]);
+	}
+
+	// Typical size of a change in cost, to start the temperature from
+	float MeanDelta(u_int numSamples)
+	{
+		float sum = 0;
+		for (u_int sample = 0; sample < numSamples; ++sample)
+		{
+			auto [key1, key2] = randomPair();
+			sum+= fabs(SwapDelta(key1, key2));
+		}
+
+		return sum / numSamples;
+	}
+
+	void Run(uint64_t numSteps, float startTemperature, float endTemperature)
+	{
+		float temperature = startTemperature;
+		float cooling = pow(endTemperature / startTemperature, 1.0f / numSteps);
+		for (uint64_t step = 0; step < numSteps; ++step, temperature*= cooling)
+		{
+			auto [key1, key2] = randomPair();
+			float delta = SwapDelta(key1, key2);
+			if (delta > 0 && uniform() >= exp(-delta / temperature))
+				continue;
+
+			Swap(key1, key2);
+			cost+= delta;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSlotOf = slotOf;
+			}
+		}
+	}
+
+	const array<u_char, NumKeys> &GetBest() const { return bestSlotOf; }
+
+private:
+	pair<size_t, size_t> randomPair()
+	{
+		size_t key1 = pick(numSearchedKeys), key2 = pick(numSearchedKeys - 1);
+		return {key1, key2 + (key2 >= key1)};
+	}
+
+	size_t pick(size_t count)
+	{
+		return (random() >> 32) * count >> 32;
+	}
+
+	float uniform()
+	{
+		return (random() >> 40) * (1.0f / (1 << 24));
+	}
+
+	const CostModel &model;
+	mt19937_64 random;
+	array<u_char, NumKeys> slotOf, bestSlotOf;
+	array<array<float, NumKeys>, NumKeys> costTo;
+	float cost, bestCost;
+};
+
+// Letters of either case and the punctuation on the searched keys, shifted or not
+static array<u_char, 256>
+textKeys()
+{
+	array<u_char, 256> keys;
+	keys.fill(NoKey);
+	for (size_t key = 0; key < numSearchedKeys; ++key)
+	{
+		string_view name = qwertyPositions[key].Name;
+		if (name.size() == 1)
+			keys[(u_char)name[0]] = keys[(u_char)tolower(name[0])] = key;
+	}
+
+	static constexpr pair<string_view, string_view> punctuation[] =
+		{{"Semicol", ";:"}, {"Apostro", "'\""}, {"Comma", ",<"}, {"Dot", ".>"}, {"Slash", "/?"}};
+	for (const auto &[name, chars] : punctuation)
+		for (size_t key = 0; key < numSearchedKeys; ++key)
+			if (qwertyPositions[key].Name == name)
+				for (char ch : chars)
+					keys[(u_char)ch] = key;
+
+	return keys;
+}
+
+// Key names as in patch files, one keystroke each
+static void
+readKeystrokes(istream &is, CostModel &model)
+{
+	array<u_char, 256> keysByUsage;
+	keysByUsage.fill(NoKey);
+	for (size_t key = 0; key < numSearchedKeys; ++key)
+		keysByUsage[*USBKeys::Find(qwertyPositions[key].Name)] = key;
+
+	string name;
+	while (is >> name)
+	{
+		auto usage = USBKeys::Find(name);
+		model.AddKey(usage ? keysByUsage[*usage] : NoKey);
+	}
+}
+
+static void
+readText(istream &is, CostModel &model)
+{
+	static const array<u_char, 256> keys = textKeys();
+	vector<char> buffer(1 << 16);
+	while (is.read(buffer.data(), buffer.size()) || is.gcount() > 0)
+		for (streamsize index = 0; index < is.gcount(); ++index)
+			model.AddKey(keys[(u_char)buffer[index]]);
+}
+
+int
+main(int ac, char *av[])
+{
+	const char *inputPath = nullptr;
+	bool keystrokes = false;
+	CostModel::Weights weights;
+	uint64_t numSteps = 1000000;
+	u_int numChains = 0, numThreads = 0;
+	uint64_t seed = 1;
+
+	ios_base::sync_with_stdio(false);
+
+	int ch;
+	while ((ch = getopt(ac, av, "a:c:d:i:j:kn:r:s:")) != -1)
+		switch (ch)
+		{
+			case 'a':
+				weights.SameHand = stof(optarg);
+				break;
+
+			case 'c':
+				numChains = stoul(optarg);
+				break;
+
+			case 'd':
+				weights.Travel = stof(optarg);
+				break;
+
+			case 'i':
+				inputPath = optarg;
+				break;
+
+			case 'j':
+				numThreads = stoul(optarg);
+				break;
+
+			case 'k':
+				keystrokes = true;
+				break;
+
+			case 'n':
+				numSteps = stoull(optarg);
+				break;
+
+			case 'r':
+				seed = stoull(optarg);
+				break;
+
+			case 's':
+				weights.SameFinger = stof(optarg);
+				break;
+
+			default:
+				goto usage;
+		}
+
+	ac-= optind;
+	av+= optind - 1;
+
+	if (!inputPath || numSteps == 0)
+	{
+usage:
+		cerr << "usage: " << getprogname() << " -i <file.hex> [-k] [-d <weight>] [-s <weight>] [-a <weight>] [-n <steps>] "
+				"[-c <chains>] [-j <threads>] [-r <seed>] [<corpus>...] > <file.patch>" << endl;
+		cerr << "-i <file.hex>\tImage with the QWERTY scancode table, whose letter keys are moved around" << endl;
+		cerr << "-k\t\tThe corpus is key names as in patch files instead of text" << endl;
+		cerr << "-d <weight>\tCost of moving a finger one key from home (default " << weights.Travel << ')' << endl;
+		cerr << "-s <weight>\tCost of typing two keys in turn with one finger (default " << weights.SameFinger << ')' << endl;
+		cerr << "-a <weight>\tCost of typing two keys in turn with one hand (default " << weights.SameHand << ')' << endl;
+		cerr << "-n <steps>\tSwaps tried by each annealing chain (default " << numSteps << ')' << endl;
+		cerr << "-c <chains>\tNumber of annealing chains, the best of which wins (default one per thread)" << endl;
+		cerr << "-j <threads>\tNumber of chains to run at once (default one per CPU)" << endl;
+		cerr << "-r <seed>\tSeed of the first chain's random numbers (default 1)" << endl;
+		return 64; // EX_USAGE
+	}
+
+	HexFile input;
+	HexImage::Load(inputPath, input);
+
+	u_int tableBegin = KeyTable::DefaultBegin, tableEnd = KeyTable::DefaultEnd;
+	if (const Firmware::Entry *firmware = Firmware::Identify(input))
+	{
+		tableBegin = firmware->TableBegin;
+		tableEnd = firmware->TableEnd;
+	}
+
+	// Where each slot is in the table; the image's own layout is taken to be QWERTY
+	vector<u_char> table(tableEnd - tableBegin);
+	array<vector<u_int>, numSearchedKeys> slotAddresses;
+	for (u_int address = tableBegin; address < tableEnd; ++address)
+	{
+		if (!input.IsPresent(address))
+			throw runtime_error("Scancode table has no byte at " + to_string(address));
+
+		table[address - tableBegin] = input[address];
+		for (size_t slot = 0; slot < numSearchedKeys; ++slot)
+			if (input[address] == *USBKeys::Find(qwertyPositions[slot].Name))
+				slotAddresses[slot].push_back(address);
+	}
+
+	for (size_t slot = 0; slot < numSearchedKeys; ++slot)
+		if (slotAddresses[slot].empty())
+			throw runtime_error(string(qwertyPositions[slot].Name) + " is not in the scancode table");
+
+	CostModel model(weights);
+	auto start = chrono::steady_clock::now();
+	if (ac == 0)
+		keystrokes ? readKeystrokes(cin, model) : readText(cin, model);
+	for (int index = 1; index <= ac; ++index)
+	{
+		ifstream corpus(av[index], ios_base::binary);
+		if (!corpus.is_open())
+			throw runtime_error("Could not open "s + av[index]);
+
+		keystrokes ? readKeystrokes(corpus, model) : readText(corpus, model);
+		model.AddKey(NoKey);
+	}
+
+	if (model.GetNumKeystrokes() == 0)
+		throw runtime_error("Corpus has none of the keys searched");
+	clog << "Read " << model.GetNumKeystrokes() << " keystrokes in " <<
+			chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+
+	ThreadPool pool(numThreads);
+	if (numChains == 0)
+		numChains = pool.GetNumThreads();
+
+	vector<LayoutAnnealer> chains;
+	chains.reserve(numChains);
+	for (u_int chain = 0; chain < numChains; ++chain)
+		chains.emplace_back(model, seed + chain);
+
+	float startTemperature = max(chains[0].MeanDelta(1000), 1e-6f), endTemperature = startTemperature / 1000;
+	start = chrono::steady_clock::now();
+	pool.Run(numChains, [&](size_t chain) { chains[chain].Run(numSteps, startTemperature, endTemperature); });
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	// Costs are worked out again in full, as the running ones pick up rounding errors
+	array<u_char, NumKeys> qwerty, best;
+	for (size_t key = 0; key < NumKeys; ++key)
+		qwerty[key] = key;
+	best = qwerty;
+	for (const LayoutAnnealer &chain : chains)
+		if (model.Cost(chain.GetBest()) < model.Cost(best))
+			best = chain.GetBest();
+
+	double perKeystroke = 1.0 / model.GetNumKeystrokes();
+	clog << "Tried " << numChains * numSteps << " swaps in " << seconds << " s, " <<
+			numChains * numSteps / seconds / min(numChains, pool.GetNumThreads()) / 1e6 << " million per second per thread" <<
+			endl;
+	clog << "Cost per keystroke " << model.Cost(qwerty) * perKeystroke << " for QWERTY, " <<
+			model.Cost(best) * perKeystroke << " for the layout found" << endl;
+
+	for (size_t key = 0; key < numSearchedKeys; ++key)
+		for (u_int address : slotAddresses[best[key]])
+			table[address - tableBegin] = *USBKeys::Find(qwertyPositions[key].Name);
+
+	for (u_int rowBegin = tableBegin; rowBegin < tableEnd; rowBegin+= KeyTable::KeysPerRow)
+	{
+		cout << hex << setw(4) << setfill('0') << rowBegin << ":\tkeys";
+		for (u_int address = rowBegin; address < min(rowBegin + KeyTable::KeysPerRow, tableEnd); ++address)
+			cout << '\t' << KeyDump::PatchName(table[address - tableBegin]);
+		cout << endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+enum class LoaderCommand : uint8_t
+{
+	Enter  = 0x38,
+	Write  = 0x39,
+	Verify = 0x3a,
+	Exit   = 0x3b,
+};
+
+enum StatusFlag : uint8_t
+{
+	Success =       0x01,
+	BadLowSum =     0x02, // Checksum of 0x80 to 0x1300 invalid
+	VerifyFailed =  0x04,
+	Protected =     0x08,
+	BadCheckSum =   0x10,
+	ReadyToWrite =  0x20,
+	BadHeader =     0x40, // Bad magic number 0xff or ordinal numbers
+	BadCommand =    0x80,
+};
+
+struct alignas(1) LoaderMessage
+{
+	LoaderMessage() = default;
+
+	// TODO payload view
+	LoaderMessage(LoaderCommand command, uint8_t blockNum = 0, uint8_t secondHalf = 0, const uint8_t *payload = nullptr, size_t payloadLength = 0)
+		: Magic(0xff)
+		, Command(command)
+		, Padding1(0)
+		, BlockNum(blockNum)
+		, SecondHalf(secondHalf)
+	{
+		for (uint_fast8_t i = 0; i < 8; ++i)
+			Ordinal[i] = i;
+
+		std::fill(Payload.begin(), Payload.end(), 0);
+
+		if (payload)
+			SetPayload(payload, payloadLength);
+		else
+			updateCheckSum();
+
+		std::fill(Padding2.begin(), Padding2.end(), 0);
+	}
+
+	uint8_t GetBlockNum() const { return BlockNum; }
+	uint8_t GetCheckSum() const { return CheckSum; }
+
+	// TODO: payload view
+	void SetPayload(const uint8_t *payload, size_t payloadLength)
+	{
+		assert(payloadLength <= 32);
+
+		std::copy(payload, payload + payloadLength, Payload.begin());
+		updateCheckSum();
+	}
+
+	const uint8_t *AsBytes() const { return reinterpret_cast<const uint8_t *>(this); }
+
+private:
+	void updateCheckSum()
+	{
+		const uint8_t * const begin = AsBytes();
+		const uint8_t * const end = &CheckSum;
+
+		CheckSum = 0;
+		for (const uint8_t *byte = begin; byte < end; ++byte)
+			CheckSum+= *byte;
+	}
+
+#ifdef __clang__
+#	pragma clang diagnostic push
+#	pragma clang diagnostic ignored "-Wunused-private-field"
+#endif
+	uint8_t Magic;			// always 0xff
+	LoaderCommand Command;
+	uint8_t Ordinal[8];		// always 0x00-07
+	uint8_t Padding1;
+	uint8_t BlockNum;
+	uint8_t SecondHalf;		// 0 or 1 for first or second 32 bytes
+	std::array<uint8_t, 32> Payload;
+	uint8_t CheckSum;		// offset 45
+	std::array<uint8_t, 18> Padding2;
+#ifdef __clang__
+#	pragma clang diagnostic pop
+#endif
+};
+static_assert(sizeof(LoaderMessage) <= 64);
+static_assert(sizeof(LoaderMessage) >= 64);
@@ -1,137 +1,384 @@
 #include "HexFile.inl"
+#include "HexImage.inl"
 #include "USBKeys.inl"
+#include "PatchFile.inl"
+#include "Firmware.inl"
+#include "HexVariant.inl"
+#include "ThreadPool.inl"
+#include "Hint.inl"
+#include "Compensate.inl"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <charconv>
+#include <cstring>
+#include <optional>
+#include <unistd.h>
 
 using namespace std;
 
-int
-main(int ac, char *av[])
+// Applies edits, sorted by address, while copying records from is to os, so only a chunk of the image is held at a
+// time. Data for the low sum range has to come before the stored sum, as it does in the firmware images.
+static int
+streamPatch(istream &is, ostream &os, const vector<PatchFile::Edit> &edits)
 {
-	bool verbose = false;
-
-	ios_base::sync_with_stdio(false);
-	freopen(NULL, "rb", stdin);
-
-	if (ac != 2)
-	{
-		cerr << "usage: " << getprogname() << " <file.patch>" << endl;
-		return 64; // EX_USAGE
-	}
-
-	HexFile input;
-	if (!(cin >> input))
-		throw runtime_error("Could not load HexFile from input");
-
-	ifstream patchStream(av[1]);
-	if (!patchStream.is_open())
-		throw runtime_error("Could not open "s + av[1]);
-
-	USBKeys keys;
+	static const size_t chunkSize = 1 << 16;
+	// A record is at least 11 characters and gains at most a carriage return on output
+	vector<u_char> text(chunkSize);
+	vector<char> output(chunkSize * 2);
 
-	string line;
-	u_int lineNum = 0;
-	u_int numErrors = 0;
-	while (getline(patchStream, line))
+	vector<bool> applied(edits.size());
+	u_int base = 0;
+	uint16_t lowSum = 0;
+	bool wroteSum = false;
+	bool done = false;
+	size_t textSize = 0;
+	while (!done && is)
 	{
-		++lineNum;
-		line.erase(find(line.begin(), line.end(), ';'), line.end());
-		istringstream lineStream(line);
+		is.read(reinterpret_cast<char *>(text.data() + textSize), text.size() - textSize);
+		textSize+= is.gcount();
 
-		try
+		// Only whole lines are parsed until the end of the input
+		const u_char *parseEnd = text.data() + textSize;
+		if (is)
 		{
-			u_int address;
-			char colon;
-			if (!(lineStream >> hex >> noshowbase >> address >> colon) || colon != ':')
-			{
-				if (lineStream.eof())
-					continue;
+			while (parseEnd > text.data() && parseEnd[-1] != '\n')
+				--parseEnd;
+			if (parseEnd == text.data())
+				throw runtime_error("Line too long on input");
+		}
 
-				throw runtime_error("Expected address:");
-			}
+		HexParser parser(text.data(), parseEnd);
+		char *position = output.data();
+		HexParser::Record parsed;
+		while (!done && parser.Next(parsed))
+		{
+			u_char data[0xff];
+			copy(parsed.Data, parsed.Data + parsed.Length, data);
 
-			string directive;
-			if (!(lineStream >> directive))
-				throw runtime_error("Expected directive");
+			HexFile::Record record;
+			record.length = parsed.Length;
+			record.address = parsed.Address;
+			record.type = parsed.Type;
+			record.base = base;
 
-			if (directive == "keys")
+			switch (record.type)
 			{
-				string keyName;
-				while ((lineStream >> keyName))
+				case 0:
 				{
-					for (auto &ch : keyName)
-						ch = toupper(ch);
-
-					u_char scanCode;
-					auto scanKey = keys.keyNames.find(keyName);
-					if (scanKey != keys.keyNames.end())
+					u_int begin = record.LinearAddress(), end = begin + record.length;
+					auto edit = lower_bound(edits.begin(), edits.end(), begin,
+							[](const PatchFile::Edit &edit, u_int address) { return edit.Address < address; });
+					for (; edit != edits.end() && edit->Address < end; ++edit)
 					{
-						scanCode = scanKey->second;
-						if (scanCode >= 0xe0 && scanCode < 0xe8)
-							scanCode+= 0x10;
+						data[edit->Address - begin] = edit->Value;
+						applied[edit - edits.begin()] = true;
 					}
-					else
+
+					for (u_int address = max<u_int>(begin, HexFile::BeginSummed); address < min<u_int>(end, HexFile::EndSummed);
+							++address)
 					{
-						try
-						{
-							size_t pos;
-							scanCode = stoul(keyName, &pos, 16);
-							if (pos != keyName.size())
-								throw invalid_argument("Unparsed scan code: " + keyName.substr(pos));
-						}
-						catch (invalid_argument &err)
+						if (wroteSum)
+							throw runtime_error("Data at " + to_string(address) + " comes after the stored low sum");
+						lowSum+= data[address - begin];
+					}
+
+					for (u_int address = HexFile::StoredSumAddress; address < HexFile::StoredSumAddress + 2u; ++address)
+						if (address >= begin && address < end)
 						{
-							lineStream.clear();
-							throw runtime_error("Unknown key code " + keyName);
-							++numErrors;
-							continue;
+							data[address - begin] = (address == HexFile::StoredSumAddress) ? lowSum >> 8 : lowSum & 0xff;
+							wroteSum = true;
 						}
-					}
 
-					if (verbose)
-						clog << hex << address << ": " << keyName << endl;
+					record.data = data;
+					break;
+				}
 
-					input[address] = scanCode;
+				case 1:
+					done = true;
+					break;
 
-					++address;
-				}
+				case 2:
+				case 3:
+				case 4:
+				case 5:
+					if (parsed.Length != record.ValueLength())
+						throw runtime_error("Invalid length " + to_string(parsed.Length) + " for record type " +
+								to_string(record.type));
+
+					for (u_int index = 0; index < parsed.Length; ++index)
+						record.value = record.value << 8 | parsed.Data[index];
 
-				if (!lineStream.eof())
-					throw runtime_error("Expected key name or hex code");
+					if (record.type == 2)
+						base = record.value << 4;
+					else if (record.type == 4)
+						base = record.value << 16;
+					break;
+
+				default:
+					throw runtime_error("Unknown record type " + to_string(record.type));
 			}
-			else if (directive == "db")
-			{
-				u_int uintChar;
-				while ((lineStream >> hex >> uintChar))
-				{
-					if (uintChar > 0xff)
-						clog << "Byte literal " << uintChar << " too large" << endl;
 
-					input[address] = uintChar;
+			position = formatRecord(position, record);
+		}
+
+		if (!os.write(output.data(), position - output.data()))
+			throw runtime_error("Could not write output");
 
-					++address;
-				}
+		textSize = text.data() + textSize - parseEnd;
+		memmove(text.data(), parseEnd, textSize);
+	}
 
-				if (!lineStream.eof())
-					throw runtime_error("Expected hex byte");
-			}
-			else
-				throw runtime_error("Unrecognized directive "s + directive);
+	if (!done)
+		cerr << "Warning: Expected end record before EOF" << endl;
+
+	int status = 0;
+	if (!wroteSum)
+	{
+		cerr << "No record holds the stored low sum at " << hex << HexFile::StoredSumAddress << endl;
+		status = 1;
+	}
+
+	for (size_t index = 0; index < edits.size(); ++index)
+		if (!applied[index])
+		{
+			cerr << "No record at address " << hex << edits[index].Address << endl;
+			status = 1;
+		}
+
+	return status;
+}
+
+struct BatchJob
+{
+	string PatchPath, OutputPath;
+};
+
+// Writes a patched image for every job, sharing input between them. Without filler compensation each one is a
+// HexVariant that copies only the blocks its patch changes; the compensator needs an image of its own.
+static int
+batchPatch(const HexFile &input, const vector<BatchJob> &jobs, unsigned numThreads,
+		const optional<vector<u_int>> &fillerAddresses, u_int targetSum, bool verbose)
+{
+	input.GetLowSum();
+	uint64_t inputHash = Firmware::Hash(input);
+
+	vector<ostringstream> logs(jobs.size());
+	vector<int> statuses(jobs.size(), 0);
+	ThreadPool pool(numThreads);
+	pool.Run(jobs.size(), [&](size_t index)
+	{
+		const BatchJob &job = jobs[index];
+		ostream &log = logs[index];
+
+		PatchFile patch(job.PatchPath, verbose);
+		if (patch.GetNumErrors() > 0)
+		{
+			statuses[index] = 1;
+			return;
+		}
+
+		if (patch.GetBaseHash() != 0 && patch.GetBaseHash() != inputHash)
+		{
+			log << job.PatchPath << ": error: Compiled for a different image" << endl;
+			statuses[index] = 1;
+			return;
+		}
+
+		ofstream outputStream(job.OutputPath, ios_base::binary | ios_base::trunc);
+		if (!outputStream.is_open())
+			throw runtime_error("Could not open " + job.OutputPath);
+
+		if (fillerAddresses)
+		{
+			HexFile image(input);
+			patch.Apply(image);
+			image.UpdateLowSum();
+			log << job.OutputPath << ": ";
+			SumCompensator::Compensate(image, patch.GetUnwritten(*fillerAddresses), targetSum, log);
+			outputStream << image;
 		}
-		catch (runtime_error &err)
+		else
 		{
-			cerr << av[1] << ':' << dec << lineNum << ':' << lineStream.tellg() << ": error: " <<  err.what() << endl;
-			++numErrors;
+			HexVariant variant(input);
+			patch.Apply(variant);
+			variant.UpdateLowSum();
+			outputStream << variant;
 		}
+
+		if (!outputStream.flush())
+			throw runtime_error("Could not write " + job.OutputPath);
+	});
+
+	for (const ostringstream &log : logs)
+		clog << log.str();
+
+	return *max_element(statuses.begin(), statuses.end());
+}
+
+int
+main(int ac, char *av[])
+{
+	bool verbose = false;
+
+	const char *hintPath = nullptr;
+	string fillerName = "_halts";
+	bool haveTargetSum = false;
+	u_int targetSum = 0;
+	const char *inputPath = nullptr;
+	bool streaming = false;
+	const char *compiledPath = nullptr;
+	bool batch = false;
+	unsigned numThreads = 0;
+
+	ios_base::sync_with_stdio(false);
+	freopen(NULL, "rb", stdin);
+
+	int ch;
+	while ((ch = getopt(ac, av, "c:f:i:j:mst:C:")) != -1)
+		switch (ch)
+		{
+			case 'c':
+				hintPath = optarg;
+				break;
+
+			case 'f':
+				fillerName = optarg;
+				break;
+
+			case 'i':
+				inputPath = optarg;
+				break;
+
+			case 'j':
+				numThreads = stoul(optarg);
+				break;
+
+			case 'm':
+				batch = true;
+				break;
+
+			case 's':
+				streaming = true;
+				break;
+
+			case 't':
+				targetSum = stoul(optarg, nullptr, 16);
+				haveTargetSum = true;
+				break;
+
+			case 'C':
+				compiledPath = optarg;
+				break;
+
+			default:
+				goto usage;
+		}
+
+	ac-= optind;
+	av+= optind - 1;
+
+	if ((batch ? (ac < 2 || ac % 2 != 0) : ac < 1) || (batch && (streaming || compiledPath)) || (streaming && hintPath) ||
+			(compiledPath && (streaming || hintPath)))
+	{
+usage:
+		cerr << "usage: " << getprogname() << " [-i <file.hex>] [-c <file.hint> [-f <section>] [-t <sum>]] <file.patch>..." <<
+				endl;
+		cerr << "       " << getprogname() << " -s [-i <file.hex>] <file.patch>..." << endl;
+		cerr << "       " << getprogname() << " -m [-j <threads>] [-i <file.hex>] [-c <file.hint> [-f <section>] [-t <sum>]] "
+				"<file.patch> <out.hex> [<file.patch> <out.hex>]..." << endl;
+		cerr << "       " << getprogname() << " -C <file.cpatch> [-i <file.hex>] <file.patch>..." << endl;
+		cerr << "<file.patch>...\tPatches applied in order as layers; where they overlap the later one wins" << endl;
+		cerr << "-i <file.hex>\tRead the input image from a file, through its binary sidecar, instead of stdin" << endl;
+		cerr << "-c <file.hint>\tChange filler bytes the patches leave alone so the image text sum stays the same, as few "
+				"as a search of up to two records finds, otherwise one in each of as many records as it takes" << endl;
+		cerr << "-f <section>\tName of the filler sections in the hint file (default _halts)" << endl;
+		cerr << "-t <sum>\tHex text sum to aim for instead of that of the input image" << endl;
+		cerr << "-m\t\tApply each patch to the same input image and write it to the output file after it" << endl;
+		cerr << "-j <threads>\tNumber of patches to apply at once with -m (default one per CPU)" << endl;
+		cerr << "-s\t\tStream the records through, holding only the patch in memory; records are not re-blocked" << endl;
+		cerr << "-C <file.cpatch>\tCheck the patch against the input image and compile it, which can then be used in place of "
+				"<file.patch>" << endl;
+		return 64; // EX_USAGE
+	}
+
+	if (streaming)
+	{
+		PatchFile patch = PatchFile::Load(av + 1, ac, verbose, clog);
+		if (patch.GetNumErrors() > 0)
+			return 1;
+
+		if (patch.GetBaseHash() != 0)
+			clog << "Warning: The image a compiled patch was made for is not checked when streaming" << endl;
+
+		if (!inputPath)
+			return streamPatch(cin, cout, patch.GetSortedEdits());
+
+		ifstream inputStream(inputPath, ios_base::binary);
+		if (!inputStream.is_open())
+			throw runtime_error("Could not open "s + inputPath);
+		return streamPatch(inputStream, cout, patch.GetSortedEdits());
 	}
 
-	if (numErrors > 0)
+	HexFile input;
+	if (inputPath)
+		HexImage::Load(inputPath, input);
+	else if (!(cin >> input))
+		throw runtime_error("Could not load HexFile from input");
+
+	if (compiledPath)
+	{
+		PatchFile patch = PatchFile::Load(av + 1, ac, verbose, clog);
+		u_int numErrors = patch.GetNumErrors();
+		for (const PatchFile::Run &run : patch.GetRuns())
+			for (u_int address = run.Address; address < run.Address + run.Length; ++address)
+				if (!input.IsPresent(address))
+				{
+					cerr << patch.GetPath() << ": error: No record at address " << hex << address << endl;
+					++numErrors;
+				}
+
+		if (numErrors > 0)
+			return 1;
+
+		patch.Compile(compiledPath, Firmware::Hash(input));
+		return 0;
+	}
+
+	HexImage::Reblock(input, inputPath ? inputPath : "<stdin>", clog);
+
+	if (!haveTargetSum)
+		targetSum = SumCompensator::TextSum(input);
+
+	optional<vector<u_int>> fillerAddresses;
+	if (hintPath)
+		fillerAddresses = Hint(hintPath).GetExclusiveAddresses(fillerName);
+
+	if (batch)
+	{
+		vector<BatchJob> jobs;
+		for (int index = 1; index < ac; index+= 2)
+			jobs.push_back({av[index], av[index + 1]});
+		return batchPatch(input, jobs, numThreads, fillerAddresses, targetSum, verbose);
+	}
+
+	PatchFile patch = PatchFile::Load(av + 1, ac, verbose, clog);
+	if (patch.GetNumErrors() > 0)
 		return 1;
 
+	if (patch.GetBaseHash() != 0 && patch.GetBaseHash() != Firmware::Hash(input))
+	{
+		cerr << patch.GetPath() << ": error: Compiled for a different image" << endl;
+		return 1;
+	}
+
+	patch.Apply(input);
+
 	input.UpdateLowSum();
 
+	if (fillerAddresses)
+		SumCompensator::Compensate(input, patch.GetUnwritten(*fillerAddresses), targetSum, clog);
+
 	cout << input;
 }
@@ -0,0 +1,359 @@
+#pragma once
+
+#include "HexFile.inl"
+#include "USBKeys.inl"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The byte edits of a patch. Patches are written as text, one line per run of bytes:
+//   <hex address>: keys <key name or hex scan code>...
+//   <hex address>: db <hex byte>...
+// with anything after a ; ignored, and errors reported per line on cerr and counted. Compile() writes the edits out as
+// sorted runs of bytes along with the hash of the image the patch was checked against, which loads without parsing.
+//
+// Compiled layout, in native byte order:
+//   Header
+//   Run[NumRuns], sorted by address and not overlapping
+//   the bytes of every run, in the same order
+class PatchFile
+{
+public:
+	struct Edit
+	{
+		u_int Address;
+		u_char Value;
+	};
+
+	struct Run
+	{
+		uint32_t Address, Length;
+	};
+
+	PatchFile(const std::string &path, bool verbose = false) : path(path)
+	{
+		std::ifstream patchStream(path, std::ios_base::binary);
+		if (!patchStream.is_open())
+			throw std::runtime_error("Could not open " + path);
+
+		char magic[sizeof(Magic)] = {};
+		if (patchStream.read(magic, sizeof(magic)) && memcmp(magic, Magic, sizeof(Magic)) == 0)
+		{
+			readCompiled(patchStream, path);
+			return;
+		}
+
+		patchStream.clear();
+		patchStream.seekg(0);
+
+		std::vector<Edit> edits;
+		std::string line;
+		u_int lineNum = 0;
+		while (getline(patchStream, line))
+		{
+			++lineNum;
+			line.erase(find(line.begin(), line.end(), ';'), line.end());
+			std::istringstream lineStream(line);
+
+			try
+			{
+				parseLine(lineStream, edits, verbose);
+			}
+			catch (std::runtime_error &err)
+			{
+				std::cerr << path << ':' << std::dec << lineNum << ':' << lineStream.tellg() << ": error: " << err.what() <<
+						std::endl;
+				++numErrors;
+			}
+		}
+
+		buildRuns(std::move(edits));
+	}
+
+	// One patch, or the patches at paths composed in order as layers
+	static PatchFile Load(char * const *paths, size_t numPaths, bool verbose, std::ostream &log)
+	{
+		if (numPaths == 1)
+			return PatchFile(paths[0], verbose);
+
+		std::vector<PatchFile> layers;
+		layers.reserve(numPaths);
+		for (size_t index = 0; index < numPaths; ++index)
+			layers.emplace_back(paths[index], verbose);
+		return Compose(layers, log);
+	}
+
+	// Applies layers in order, so where they overlap the later one wins. Each overlap is reported on log; runs are
+	// indexed by address so that finding them takes O(n log n) in the number of runs, plus one step per overlap.
+	static PatchFile Compose(const std::vector<PatchFile> &layers, std::ostream &log)
+	{
+		PatchFile composed;
+		struct LayerRun
+		{
+			uint32_t Begin, End;
+			size_t Layer;
+		};
+		std::vector<LayerRun> layerRuns;
+		std::vector<Edit> edits;
+		for (size_t layer = 0; layer < layers.size(); ++layer)
+		{
+			const PatchFile &patch = layers[layer];
+			composed.path+= (layer > 0 ? "+" : "") + patch.path;
+			composed.numErrors+= patch.numErrors;
+
+			if (patch.baseHash != 0 && composed.baseHash != 0 && patch.baseHash != composed.baseHash)
+			{
+				std::cerr << patch.path << ": error: Compiled for a different image than the layers before it" << std::endl;
+				++composed.numErrors;
+			}
+			else if (patch.baseHash != 0)
+				composed.baseHash = patch.baseHash;
+
+			for (const Run &run : patch.runs)
+				layerRuns.push_back({run.Address, run.Address + run.Length, layer});
+
+			std::vector<Edit> layerEdits = patch.GetSortedEdits();
+			edits.insert(edits.end(), layerEdits.begin(), layerEdits.end());
+		}
+
+		std::sort(layerRuns.begin(), layerRuns.end(),
+				[](const LayerRun &a, const LayerRun &b) { return a.Begin < b.Begin; });
+
+		// Runs that started earlier and are still going, by where they end
+		std::multimap<uint32_t, const LayerRun *> active;
+		for (const LayerRun &run : layerRuns)
+		{
+			active.erase(active.begin(), active.upper_bound(run.Begin));
+			for (const auto &[end, other] : active)
+			{
+				const LayerRun &earlier = (other->Layer < run.Layer) ? *other : run;
+				const LayerRun &later = (other->Layer < run.Layer) ? run : *other;
+				log << "Warning: " << layers[later.Layer].path << " overrides " << layers[earlier.Layer].path << " at " <<
+						std::hex << run.Begin << '-' << std::min(end, run.End) - 1 << std::dec << std::endl;
+			}
+			active.emplace(run.End, &run);
+		}
+
+		composed.buildRuns(std::move(edits));
+		return composed;
+	}
+
+	const std::string &GetPath() const { return path; }
+
+	u_int GetNumErrors() const { return numErrors; }
+
+	// Hash of the image a compiled patch was checked against, or 0
+	uint64_t GetBaseHash() const { return baseHash; }
+
+	const std::vector<Run> &GetRuns() const { return runs; }
+
+	// Sorted by address, with only the last edit to each address, as applying them in order would leave it
+	std::vector<Edit> GetSortedEdits() const
+	{
+		std::vector<Edit> edits;
+		edits.reserve(bytes.size());
+		const u_char *runBytes = bytes.data();
+		for (const Run &run : runs)
+			for (u_int offset = 0; offset < run.Length; ++offset)
+				edits.push_back({run.Address + offset, *runBytes++});
+		return edits;
+	}
+
+	// Those of addresses that the patch leaves alone, in the same order
+	std::vector<u_int> GetUnwritten(const std::vector<u_int> &addresses) const
+	{
+		std::vector<u_int> unwritten;
+		for (u_int address : addresses)
+		{
+			auto next = std::upper_bound(runs.begin(), runs.end(), address,
+					[](u_int value, const Run &run) { return value < run.Address; });
+			if (next == runs.begin() || address >= std::prev(next)->Address + std::prev(next)->Length)
+				unwritten.push_back(address);
+		}
+		return unwritten;
+	}
+
+	// Into a HexFile, or anything else with the same Write()
+	template<typename Image>
+	void Apply(Image &image) const
+	{
+		const u_char *runBytes = bytes.data();
+		for (const Run &run : runs)
+		{
+			image.Write(run.Address, runBytes, run.Length);
+			runBytes+= run.Length;
+		}
+	}
+
+	void Compile(const std::string &path, uint64_t imageHash) const
+	{
+		Header header;
+		memcpy(header.Magic, Magic, sizeof(Magic));
+		header.BaseHash = imageHash;
+		header.NumRuns = runs.size();
+		header.NumBytes = bytes.size();
+
+		std::ofstream compiledStream(path, std::ios_base::binary | std::ios_base::trunc);
+		compiledStream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		compiledStream.write(reinterpret_cast<const char *>(runs.data()), runs.size() * sizeof(Run));
+		compiledStream.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+		if (!compiledStream.flush())
+			throw std::runtime_error("Could not write " + path);
+	}
+
+private:
+	PatchFile() = default;
+
+	static constexpr char Magic[8] = {'H', 'E', 'X', 'P', 'A', 'T', '\0', '\1'};
+
+	struct Header
+	{
+		char Magic[8];
+		uint64_t BaseHash;
+		uint32_t NumRuns, NumBytes;
+	};
+	static_assert(sizeof(Header) == 24);
+	static_assert(sizeof(Run) == 8);
+
+	void readCompiled(std::istream &compiledStream, const std::string &path)
+	{
+		Header header;
+		memcpy(header.Magic, Magic, sizeof(Magic));
+		compiledStream.read(header.Magic + sizeof(Magic), sizeof(header) - sizeof(Magic));
+
+		std::streampos tablesBegin = compiledStream.tellg();
+		compiledStream.seekg(0, std::ios_base::end);
+		if (!compiledStream || (uint64_t)(compiledStream.tellg() - tablesBegin) != header.NumRuns * sizeof(Run) + header.NumBytes)
+			throw std::runtime_error("Compiled patch " + path + " is truncated or has extra data");
+		compiledStream.seekg(tablesBegin);
+
+		runs.resize(header.NumRuns);
+		bytes.resize(header.NumBytes);
+		compiledStream.read(reinterpret_cast<char *>(runs.data()), runs.size() * sizeof(Run));
+		compiledStream.read(reinterpret_cast<char *>(bytes.data()), bytes.size());
+		if (!compiledStream)
+			throw std::runtime_error("Could not read " + path);
+
+		uint64_t numBytes = 0;
+		for (size_t index = 0; index < runs.size(); ++index)
+		{
+			const Run &run = runs[index];
+			if (run.Length == 0 || (index > 0 && run.Address < runs[index - 1].Address + runs[index - 1].Length))
+				throw std::runtime_error("Compiled patch " + path + " has overlapping or empty runs");
+			numBytes+= run.Length;
+		}
+		if (numBytes != bytes.size())
+			throw std::runtime_error("Compiled patch " + path + " runs do not add up to its bytes");
+
+		baseHash = header.BaseHash;
+	}
+
+	// Later edits to an address replace earlier ones; edits to consecutive addresses are merged into one run
+	void buildRuns(std::vector<Edit> &&edits)
+	{
+		std::stable_sort(edits.begin(), edits.end(),
+				[](const Edit &a, const Edit &b) { return a.Address < b.Address; });
+
+		for (auto edit = edits.begin(); edit != edits.end(); ++edit)
+		{
+			if (edit + 1 != edits.end() && edit[1].Address == edit->Address)
+				continue;
+
+			if (!runs.empty() && runs.back().Address + runs.back().Length == edit->Address)
+				++runs.back().Length;
+			else
+				runs.push_back({edit->Address, 1});
+			bytes.push_back(edit->Value);
+		}
+	}
+
+	void parseLine(std::istringstream &lineStream, std::vector<Edit> &edits, bool verbose)
+	{
+		u_int address;
+		char colon;
+		if (!(lineStream >> std::hex >> std::noshowbase >> address >> colon) || colon != ':')
+		{
+			if (lineStream.eof())
+				return;
+
+			throw std::runtime_error("Expected address:");
+		}
+
+		std::string directive;
+		if (!(lineStream >> directive))
+			throw std::runtime_error("Expected directive");
+
+		if (directive == "keys")
+		{
+			std::string keyName;
+			while ((lineStream >> keyName))
+			{
+				u_char scanCode;
+				if (auto keyCode = USBKeys::Find(keyName))
+				{
+					scanCode = *keyCode;
+					if (scanCode >= 0xe0 && scanCode < 0xe8)
+						scanCode+= 0x10;
+				}
+				else
+				{
+					try
+					{
+						size_t pos;
+						scanCode = stoul(keyName, &pos, 16);
+						if (pos != keyName.size())
+							throw std::invalid_argument("Unparsed scan code: " + keyName.substr(pos));
+					}
+					catch (std::invalid_argument &err)
+					{
+						lineStream.clear();
+						throw std::runtime_error("Unknown key code " + keyName);
+					}
+				}
+
+				if (verbose)
+					std::clog << std::hex << address << ": " << keyName << std::endl;
+
+				edits.push_back({address, scanCode});
+
+				++address;
+			}
+
+			if (!lineStream.eof())
+				throw std::runtime_error("Expected key name or hex code");
+		}
+		else if (directive == "db")
+		{
+			u_int uintChar;
+			while ((lineStream >> std::hex >> uintChar))
+			{
+				if (uintChar > 0xff)
+					std::clog << "Byte literal " << uintChar << " too large" << std::endl;
+
+				edits.push_back({address, (u_char)uintChar});
+
+				++address;
+			}
+
+			if (!lineStream.eof())
+				throw std::runtime_error("Expected hex byte");
+		}
+		else
+			throw std::runtime_error("Unrecognized directive " + directive);
+	}
+
+	std::string path;
+	std::vector<Run> runs;
+	std::vector<u_char> bytes;
+	uint64_t baseHash = 0;
+	u_int numErrors = 0;
+};
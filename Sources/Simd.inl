@@ -0,0 +1,199 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSE2__)
+#	define SIMD_SSE2 1
+#	include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#	define SIMD_NEON 1
+#	include <arm_neon.h>
+#endif
+
+namespace Simd
+{
+#if SIMD_SSE2
+	static constexpr const char *Name = "SSE2";
+#elif SIMD_NEON
+	static constexpr const char *Name = "NEON";
+#else
+	static constexpr const char *Name = "scalar";
+#endif
+
+	static inline void XorBytesScalar(uint8_t *out, const uint8_t *in, const uint8_t *key, size_t length)
+	{
+		for (size_t i = 0; i < length; ++i)
+			out[i] = in[i] ^ key[i];
+	}
+
+	// out[i] = in[i] ^ key[i], in and out may be the same buffer
+	static inline void XorBytes(uint8_t *out, const uint8_t *in, const uint8_t *key, size_t length)
+	{
+		size_t i = 0;
+#if SIMD_SSE2
+		for (; i + 16 <= length; i+= 16)
+		{
+			__m128i inVec = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+			__m128i keyVec = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_xor_si128(inVec, keyVec));
+		}
+#elif SIMD_NEON
+		for (; i + 16 <= length; i+= 16)
+			vst1q_u8(out + i, veorq_u8(vld1q_u8(in + i), vld1q_u8(key + i)));
+#endif
+		XorBytesScalar(out + i, in + i, key + i, length - i);
+	}
+
+	static constexpr uint8_t NotHexDigit = 0xff;
+
+	// Value of every character as a hex digit, or NotHexDigit
+	static constexpr std::array<uint8_t, 256> HexDigitValues = []
+	{
+		std::array<uint8_t, 256> values{};
+		for (unsigned ch = 0; ch < values.size(); ++ch)
+			values[ch] = (ch >= '0' && ch <= '9') ? ch - '0' : ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') ?
+					(ch | 0x20) - 'a' + 10 : NotHexDigit;
+		return values;
+	}();
+
+	static inline bool IsHexDigit(uint8_t ch)
+	{
+		return HexDigitValues[ch] != NotHexDigit;
+	}
+
+	// Index of the first byte that is not a hex digit, or length if there is none
+	static inline size_t FindNonHexDigit(const uint8_t *bytes, size_t length)
+	{
+		size_t i = 0;
+#if SIMD_SSE2
+		const __m128i beforeZero = _mm_set1_epi8('0' - 1), afterNine = _mm_set1_epi8('9' + 1);
+		const __m128i beforeA = _mm_set1_epi8('a' - 1), afterF = _mm_set1_epi8('f' + 1), lowerCase = _mm_set1_epi8(0x20);
+		for (; i + 16 <= length; i+= 16)
+		{
+			__m128i vec = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+			__m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(vec, beforeZero), _mm_cmplt_epi8(vec, afterNine));
+			__m128i lower = _mm_or_si128(vec, lowerCase);
+			__m128i isLetter = _mm_and_si128(_mm_cmpgt_epi8(lower, beforeA), _mm_cmplt_epi8(lower, afterF));
+			int mask = _mm_movemask_epi8(_mm_or_si128(isDigit, isLetter));
+			if (mask != 0xffff)
+				return i + __builtin_ctz(~mask);
+		}
+#elif SIMD_NEON
+		for (; i + 16 <= length; i+= 16)
+		{
+			uint8x16_t vec = vld1q_u8(bytes + i);
+			uint8x16_t isDigit = vcleq_u8(vsubq_u8(vec, vdupq_n_u8('0')), vdupq_n_u8(9));
+			uint8x16_t isLetter = vcleq_u8(vsubq_u8(vorrq_u8(vec, vdupq_n_u8(0x20)), vdupq_n_u8('a')), vdupq_n_u8(5));
+			if (vminvq_u8(vorrq_u8(isDigit, isLetter)) != 0xff)
+				break;
+		}
+#endif
+		for (; i < length; ++i)
+			if (!IsHexDigit(bytes[i]))
+				return i;
+		return length;
+	}
+
+	// Index of the first byte where a and b differ, or length if they are the same
+	static inline size_t FindDifference(const uint8_t *a, const uint8_t *b, size_t length)
+	{
+		size_t i = 0;
+#if SIMD_SSE2
+		for (; i + 16 <= length; i+= 16)
+		{
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)),
+					_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i))));
+			if (mask != 0xffff)
+				return i + __builtin_ctz(~mask);
+		}
+#elif SIMD_NEON
+		for (; i + 16 <= length; i+= 16)
+			if (vminvq_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i))) != 0xff)
+				break;
+#endif
+		for (; i < length; ++i)
+			if (a[i] != b[i])
+				return i;
+		return length;
+	}
+
+	// out[i] = digits[2 * i] << 4 | digits[2 * i + 1] for numBytes bytes; the digits must already have been validated
+	static inline void DecodeHexDigits(uint8_t *out, const uint8_t *digits, size_t numBytes)
+	{
+		size_t i = 0;
+#if SIMD_SSE2
+		// A digit's value is its low nybble, plus 9 for letters, which are the only digits with bit 6 set
+		const __m128i lowNybble = _mm_set1_epi8(0x0f), letterBit = _mm_set1_epi8(0x40), letterOffset = _mm_set1_epi8(9);
+		const __m128i highInLowByte = _mm_set1_epi16(0x00f0);
+		for (; i + 8 <= numBytes; i+= 8)
+		{
+			__m128i vec = _mm_loadu_si128(reinterpret_cast<const __m128i *>(digits + i * 2));
+			__m128i isLetter = _mm_cmpeq_epi8(_mm_and_si128(vec, letterBit), letterBit);
+			__m128i values = _mm_add_epi8(_mm_and_si128(vec, lowNybble), _mm_and_si128(isLetter, letterOffset));
+			// Each 16-bit lane holds the high digit in its low byte and the low digit in its high byte
+			__m128i bytes = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(values, 4), highInLowByte), _mm_srli_epi16(values, 8));
+			_mm_storel_epi64(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(bytes, bytes));
+		}
+#elif SIMD_NEON
+		for (; i + 16 <= numBytes; i+= 16)
+		{
+			uint8x16x2_t pairs = vld2q_u8(digits + i * 2);
+			auto values = [](uint8x16_t vec)
+			{
+				uint8x16_t isLetter = vtstq_u8(vec, vdupq_n_u8(0x40));
+				return vaddq_u8(vandq_u8(vec, vdupq_n_u8(0x0f)), vandq_u8(isLetter, vdupq_n_u8(9)));
+			};
+			vst1q_u8(out + i, vorrq_u8(vshlq_n_u8(values(pairs.val[0]), 4), values(pairs.val[1])));
+		}
+#endif
+		for (; i < numBytes; ++i)
+			out[i] = HexDigitValues[digits[i * 2]] << 4 | HexDigitValues[digits[i * 2 + 1]];
+	}
+
+	// Sum of all bytes, accumulated 16 bytes at a time
+	static inline uint32_t SumBytes(const uint8_t *bytes, size_t length)
+	{
+		uint32_t sum = 0;
+		size_t i = 0;
+#if SIMD_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		__m128i sums = zero;
+		for (; i + 16 <= length; i+= 16)
+			sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i)), zero));
+		sum = _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+#elif SIMD_NEON
+		uint32x4_t sums = vdupq_n_u32(0);
+		for (; i + 16 <= length; i+= 16)
+			sums = vpadalq_u16(sums, vpaddlq_u8(vld1q_u8(bytes + i)));
+		sum = vaddvq_u32(sums);
+#endif
+		for (; i < length; ++i)
+			sum+= bytes[i];
+		return sum;
+	}
+
+	// Sum of (a1[i] - a2[i]) * (b1[i] - b2[i]), four lanes at a time
+	static inline float DotOfDifferences(const float *a1, const float *a2, const float *b1, const float *b2, size_t length)
+	{
+		float sum = 0;
+		size_t i = 0, vectorLength = length & ~size_t(3);
+#if SIMD_SSE2
+		__m128 sums = _mm_setzero_ps();
+		for (; i < vectorLength; i+= 4)
+			sums = _mm_add_ps(sums, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(a1 + i), _mm_loadu_ps(a2 + i)),
+					_mm_sub_ps(_mm_loadu_ps(b1 + i), _mm_loadu_ps(b2 + i))));
+		sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+		sum = _mm_cvtss_f32(_mm_add_ss(sums, _mm_shuffle_ps(sums, sums, 1)));
+#elif SIMD_NEON
+		float32x4_t sums = vdupq_n_f32(0);
+		for (; i < vectorLength; i+= 4)
+			sums = vmlaq_f32(sums, vsubq_f32(vld1q_f32(a1 + i), vld1q_f32(a2 + i)), vsubq_f32(vld1q_f32(b1 + i), vld1q_f32(b2 + i)));
+		sum = vaddvq_f32(sums);
+#endif
+		for (; i < length; ++i)
+			sum+= (a1[i] - a2[i]) * (b1[i] - b2[i]);
+		return sum;
+	}
+};
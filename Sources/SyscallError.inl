@@ -1,3 +1,7 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
 #include <string>
 #include <stdexcept>
 
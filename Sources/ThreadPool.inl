@@ -0,0 +1,117 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <vector>
+#include <exception>
+#include <algorithm>
+
+// Fixed set of worker threads that run indexed batches of tasks. The calling thread also works on the batch, so a
+// pool of one thread runs everything inline.
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned numThreads = 0)
+	{
+		if (numThreads == 0)
+			numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+		for (unsigned threadIndex = 1; threadIndex < numThreads; ++threadIndex)
+			workers.emplace_back([this] { workerLoop(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeWorkers.notify_all();
+
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	unsigned GetNumThreads() const { return workers.size() + 1; }
+
+	// Call func(taskIndex) for every index in [0, numTasks) and wait for all of them; rethrows the first exception
+	void Run(size_t numTasks, const std::function<void (size_t)> &func)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			task = &func;
+			taskCount = numTasks;
+			nextTask = 0;
+			busyWorkers = workers.size();
+			error = nullptr;
+			++generation;
+		}
+		wakeWorkers.notify_all();
+
+		runTasks();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		batchDone.wait(lock, [this] { return busyWorkers == 0; });
+		task = nullptr;
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+private:
+	void runTasks()
+	{
+		size_t taskIndex;
+		while ((taskIndex = nextTask++) < taskCount)
+		{
+			try
+			{
+				(*task)(taskIndex);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+			}
+		}
+	}
+
+	void workerLoop()
+	{
+		unsigned seenGeneration = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeWorkers.wait(lock, [&] { return stopping || generation != seenGeneration; });
+				if (stopping)
+					return;
+				seenGeneration = generation;
+			}
+
+			runTasks();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--busyWorkers == 0)
+				batchDone.notify_one();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wakeWorkers, batchDone;
+	const std::function<void (size_t)> *task = nullptr;
+	size_t taskCount = 0;
+	std::atomic<size_t> nextTask{0};
+	size_t busyWorkers = 0;
+	unsigned generation = 0;
+	bool stopping = false;
+	std::exception_ptr error;
+};
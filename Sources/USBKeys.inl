@@ -1,88 +1,166 @@
-#include <iostream>
-#include <fstream>
-#include <unordered_map>
+#pragma once
 
-class USBKeys
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <string_view>
+#include <sys/types.h>
+
+// Builds the USBKeys tables; separate so that they can be computed while USBKeys is being defined
+class USBKeyTable
 {
 public:
-	static bool verbose;
+	static constexpr size_t MaxNameLength = 7;
 
-	USBKeys()
+	struct Definition
 	{
-		std::ifstream hidKeysFile;
-		static const std::string hidKeysPath = "Vendor/usb_hid_keys.h";
-		hidKeysFile.open(hidKeysPath);
-		if (!hidKeysFile)
-			throw std::runtime_error(std::string("Could not open ") + hidKeysPath);
-
-		while (hidKeysFile)
-		{
-			char pound;
-			hidKeysFile >> pound;
-			if (pound == '#')
-			{
-				std::string directive;
-				hidKeysFile >> directive;
-				if (directive != "define")
-					continue;
-
-				std::string keyName;
-				hidKeysFile >> keyName;
-				static const std::string identPrefix = "KEY_";
-				if (keyName.compare(0, identPrefix.length(), identPrefix) != 0)
-					continue;
+		std::string_view Name;		// Without KEY_
+		u_int Code;
+	};
 
-				keyName.erase(0, identPrefix.length());
+	static constexpr Definition Definitions[] =
+	{
+#include "USBKeyList.inl"
+	};
 
-				std::string mid = keyName.substr(0, 4);
-				if (mid == "MOD_" || mid == "ERR_")
-					continue;
+	struct Key
+	{
+		std::string_view Name;
+		uint64_t Packed;
+		u_char Code;
+	};
 
-				static const std::string mediaPrefix = "MEDIA_";
-				if (keyName.compare(0, mediaPrefix.length(), mediaPrefix) == 0)
-					keyName.erase(0, mediaPrefix.length());
+	static constexpr size_t MaxKeys = std::size(Definitions) + 2;
+	static_assert(MaxKeys < 0x100, "Slots hold key numbers in a byte");
 
-				if (keyName.length() > maxKeyNameLength)
-					keyName.erase(maxKeyNameLength);
+	static constexpr u_int HashBits = 12;
 
-				u_int scanCode;
-				hidKeysFile >> std::hex >> scanCode;
-				AddKey(keyName, scanCode);
-			}
+	struct Table
+	{
+		std::array<Key, MaxKeys> Keys{};
+		size_t NumKeys = 0;
+		std::array<std::string_view, 0x100> Names{};
+		uint64_t Multiplier = 0;
+		std::array<u_char, 1 << HashBits> Slots{};		// Key number + 1, or 0 for no key
+	};
+
+	static constexpr uint64_t Pack(std::string_view name)
+	{
+		if (name.empty() || name.size() > MaxNameLength)
+			return 0;
 
-			char restOfLine[1024];
-			hidKeysFile.getline(restOfLine, std::size(restOfLine));
+		uint64_t packed = 0;
+		for (size_t index = 0; index < name.size(); ++index)
+		{
+			char ch = name[index];
+			if (ch >= 'a' && ch <= 'z')
+				ch-= 'a' - 'A';
+			packed|= uint64_t(u_char(ch)) << (index * 8);
 		}
 
-		AddKey("EJECT", 0xfc, true);
-		AddKey("FN", 0xf8, true);
+		return packed;
 	}
 
-	static constexpr size_t maxKeyNameLength = 7;
-	std::unordered_map<std::string, u_char> keyNames;
-	std::unordered_map<u_char, std::string> keyCodes;
+	static constexpr size_t HashSlot(uint64_t packed, uint64_t multiplier)
+	{
+		return (packed * multiplier) >> (64 - HashBits);
+	}
 
-private:
-	void AddKey(const std::string &keyName, u_char scanCode, bool overwrite = false)
+	static constexpr Table Make()
 	{
-		if (keyCodes.find(scanCode) != keyCodes.end() && !overwrite)
+		Table table{};
+
+		auto addKey = [&table](std::string_view name, u_char code, bool overwrite)
+		{
+			if (!table.Names[code].empty() && !overwrite)
+				return;
+
+			table.Names[code] = name;
+
+			for (size_t index = 0; index < table.NumKeys; ++index)
+				if (table.Keys[index].Name == name)
+				{
+					if (overwrite)
+						table.Keys[index].Code = code;
+					return;
+				}
+
+			table.Keys[table.NumKeys++] = {name, Pack(name), code};
+		};
+
+		for (const Definition &definition : Definitions)
 		{
-			std::cerr << "Already have a scancode for " << scanCode << ": " << keyCodes.at(scanCode) << std::endl;
-			return;
+			std::string_view name = definition.Name;
+			if (name.substr(0, 4) == "MOD_" || name.substr(0, 4) == "ERR_")
+				continue;
+
+			if (name.substr(0, 6) == "MEDIA_")
+				name.remove_prefix(6);
+
+			addKey(name.substr(0, MaxNameLength), definition.Code, false);
 		}
 
-		keyCodes[scanCode] = keyName;
+		addKey("EJECT", 0xfc, true);
+		addKey("FN", 0xf8, true);
 
-		//std::clog << keyName << scanCode << std::endl;
-		if (keyNames.find(keyName) != keyNames.end() && !overwrite)
+		// Odd multipliers from an LCG until one puts every key in its own slot
+		uint64_t candidate = 0x9e3779b97f4a7c15;
+		for (u_int attempt = 0; attempt < 1000 && table.Multiplier == 0; ++attempt)
 		{
-			if (verbose)
-				std::cerr << "Already have a name for " << keyName << ": " << std::hex << (u_int)keyNames.at(keyName) << std::endl;
-			return;
+			candidate = candidate * 6364136223846793005 + 1442695040888963407;
+			uint64_t multiplier = candidate | 1;
+
+			table.Slots = {};
+			bool collided = false;
+			for (size_t index = 0; index < table.NumKeys && !collided; ++index)
+			{
+				u_char &slot = table.Slots[HashSlot(table.Keys[index].Packed, multiplier)];
+				collided = (slot != 0);
+				slot = index + 1;
+			}
+
+			if (!collided)
+				table.Multiplier = multiplier;
 		}
 
-		keyNames[keyName] = scanCode;
+		return table;
 	}
 };
 
-bool USBKeys::verbose = false;
+// HID keyboard usages and their names, built at compile time from the KEY_ definitions of Vendor/usb_hid_keys.h,
+// which the Makefile lists in USBKeyList.inl. Names lose their KEY_ and MEDIA_ prefixes and are cut to
+// maxKeyNameLength characters. Where names share a code, or names are the same once cut, the first one wins; EJECT
+// and FN then take over the codes Apple uses for those keys.
+//
+// Names are looked up ignoring case by packing their characters into an integer, which a multiply-shift hash maps to
+// a slot no other name uses.
+class USBKeys
+{
+public:
+	static constexpr size_t maxKeyNameLength = USBKeyTable::MaxNameLength;
+
+	// Or nullopt if no key has the name
+	static constexpr std::optional<u_char> Find(std::string_view name)
+	{
+		uint64_t packed = USBKeyTable::Pack(name);
+		if (packed == 0)
+			return std::nullopt;
+
+		u_char slot = table.Slots[USBKeyTable::HashSlot(packed, table.Multiplier)];
+		if (slot == 0 || table.Keys[slot - 1].Packed != packed)
+			return std::nullopt;
+
+		return table.Keys[slot - 1].Code;
+	}
+
+	// Empty if the code has no name
+	static constexpr std::string_view Name(u_char code)
+	{
+		return table.Names[code];
+	}
+
+private:
+	static constexpr USBKeyTable::Table table = USBKeyTable::Make();
+	static_assert(table.Multiplier != 0, "No multiplier hashes every key name to its own slot");
+};
@@ -1,10 +1,16 @@
 #include <libusb.h>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <iterator>
 #include <algorithm>
 #include <unistd.h>
 #include "HexFile.inl"
+#include "HexImage.inl"
+#include "Firmware.inl"
+#include "Keystream.inl"
 #include "Format.inl"
+#include "Loader.inl"
 #include "SyscallError.inl"
 
 #if LIBUSB_API_VERSION < 0x0100010A
@@ -15,6 +21,8 @@ using std::string;
 using std::ios_base;
 using std::ostream;
 using std::ifstream;
+using std::istringstream;
+using std::istreambuf_iterator;
 using std::clog;
 using std::cerr;
 using std::endl;
@@ -31,91 +39,6 @@ using std::strlen;
 
 uint_fast8_t verbosity = 0;
 
-enum class LoaderCommand : uint8_t
-{
-	Enter  = 0x38,
-	Write  = 0x39,
-	Verify = 0x3a,
-	Exit   = 0x3b,
-};
-
-enum StatusFlag : uint8_t
-{
-	Success =       0x01,
-	BadLowSum =     0x02, // Checksum of 0x80 to 0x1300 invalid
-	VerifyFailed =  0x04,
-	Protected =     0x08,
-	BadCheckSum =   0x10,
-	ReadyToWrite =  0x20,
-	BadHeader =     0x40, // Bad magic number 0xff or ordinal numbers
-	BadCommand =    0x80,
-};
-
-struct alignas(1) LoaderMessage
-{
-	LoaderMessage() = default;
-
-	// TODO payload view
-	LoaderMessage(LoaderCommand command, uint8_t blockNum = 0, uint8_t secondHalf = 0, const uint8_t *payload = nullptr, size_t payloadLength = 0)
-		: Magic(0xff)
-		, Command(command)
-		, Padding1(0)
-		, BlockNum(blockNum)
-		, SecondHalf(secondHalf)
-	{
-		for (uint_fast8_t i = 0; i < 8; ++i)
-			Ordinal[i] = i;
-
-		std::fill(Payload.begin(), Payload.end(), 0);
-
-		if (payload)
-			SetPayload(payload, payloadLength);
-		else
-			updateCheckSum();
-
-		std::fill(Padding2.begin(), Padding2.end(), 0);
-	}
-
-	uint8_t GetBlockNum() const { return BlockNum; }
-
-	// TODO: payload view
-	void SetPayload(const uint8_t *payload, size_t payloadLength)
-	{
-		assert(payloadLength <= 32);
-
-		std::copy(payload, payload + payloadLength, Payload.begin());
-		updateCheckSum();
-	}
-
-	const uint8_t *AsBytes() const { return reinterpret_cast<const uint8_t *>(this); }
-
-private:
-	void updateCheckSum()
-	{
-		const uint8_t * const begin = AsBytes();
-		const uint8_t * const end = &CheckSum;
-
-		CheckSum = 0;
-		for (const uint8_t *byte = begin; byte < end; ++byte)
-			CheckSum+= *byte;
-	}
-
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunused-private-field"
-	uint8_t Magic;			// always 0xff
-	LoaderCommand Command;
-	uint8_t Ordinal[8];		// always 0x00-07
-	uint8_t Padding1;
-	uint8_t BlockNum;
-	uint8_t SecondHalf;		// 0 or 1 for first or second 32 bytes
-	array<uint8_t, 32> Payload;
-	uint8_t CheckSum;		// offset 45
-	array<uint8_t, 18> Padding2;
-#pragma clang diagnostic pop
-};
-static_assert(sizeof(LoaderMessage) <= 64);
-static_assert(sizeof(LoaderMessage) >= 64);
-
 static void verifyLibUSB(const string &desc, int usb_error)
 {
 	if (usb_error < 0)
@@ -514,7 +437,7 @@ static void writeOrVerifyBlock(libusb_device_handle &handle, const HexFile::Reco
 	for (int half = 0; half < 2; ++half)
 	{
 		LoaderMessage message(shouldWrite ? LoaderCommand::Write : LoaderCommand::Verify, blockNum, half);
-		message.SetPayload(std::get<vector<u_char>>(record.data).data() + half * 32, 32);
+		message.SetPayload(record.data + half * 32, 32);
 		sendMessage(handle, message);
 	}
 }
@@ -585,16 +508,32 @@ static void listDevices(libusb_device **devices, size_t numDevices)
 //   endif
 // endif
 
-static void readHexFile(const char *fileName, HexFile &hexFile, bool ignoreCheckSum)
+// Parses the text of a .hex file, or of an .irrxfw image as shipped by Apple, which is decoded in memory
+static void parseHexFile(const string &fileName, HexFile &hexFile)
 {
-	ifstream hexStream(fileName);
-	if (!hexStream.is_open())
-		throw SyscallError(string("Could not open hex file ") + fileName);
+	ifstream fileStream(fileName, ios_base::binary);
+	if (!fileStream.is_open())
+		throw SyscallError("Could not open hex file " + fileName);
+
+	string image((istreambuf_iterator<char>(fileStream)), istreambuf_iterator<char>());
+	fileStream.close();
 
+	if (!image.empty() && Keystream::IsCoded(image[0]))
+	{
+		u_char *bytes = reinterpret_cast<u_char *>(image.data());
+		Keystream::Apply(bytes, bytes, image.size());
+	}
+
+	istringstream hexStream(image);
 	hexStream >> hexFile;
-	hexStream.close();
+}
+
+static void readHexFile(const char *fileName, HexFile &hexFile, bool ignoreCheckSum)
+{
+	// The loader only takes whole aligned blocks
+	HexImage::LoadBlocks(fileName, hexFile, clog, parseHexFile);
 
-	uint16_t computedSum = hexFile.SumLowBlocks();
+	uint16_t computedSum = hexFile.GetLowSum();
 	uint16_t storedSum = hexFile.GetStoredLowSum();
 
 	if (!ignoreCheckSum && computedSum != storedSum)
@@ -605,20 +544,20 @@ static void readHexFile(const char *fileName, HexFile &hexFile, bool ignoreCheck
 			" have sum " << Format::Hex(computedSum) << ", stored sum is " << Format::Hex(storedSum) << endl;
 }
 
-static void writeOrVerify(libusb_device_handle &handle, const HexFile &hexFile, bool shouldWrite)
+static void writeOrVerify(libusb_device_handle &handle, const HexFile &hexFile, bool shouldWrite,
+		u_int loaderEnd = HexFile::FlashEnd)
 {
 	if (!verbosity)
 		clog << (shouldWrite ? "Writing" : "Verifying") << " blocks [" << flush;
 
-	uint16_t segment = 0;
-
 	for (const HexFile::Record &record : hexFile.records)
 	{
 		switch (record.type)
 		{
 			case 0:
 			{
-				if (segment > 0)
+				// Only the first 64K is flash; the config and EEPROM regions above it are not written by the loader
+				if (record.LinearAddress() >= loaderEnd)
 					continue;
 
 				if (record.length != 64)
@@ -638,11 +577,10 @@ static void writeOrVerify(libusb_device_handle &handle, const HexFile &hexFile,
 				break;
 			}
 
+			case 2:
 			case 4:
 				if (verbosity)
-					clog << "New segment starting at " << Format::Hex(record.address) << '\n';
-
-				segment = std::get<uint16_t>(record.data);
+					clog << "New segment starting at " << Format::Hex(record.value << ((record.type == 2) ? 4 : 16)) << '\n';
 
 				break;
 
@@ -660,6 +598,7 @@ int main(int ac, char * const *av)
 	int deviceAddress = -1, busNumber = -1;
 	bool assumeLoader = false;
 	bool ignoreCheckSum = false;
+	bool force = false;
 	const char *execName = av[0];
 	extern int optind;
 	extern char *optarg;
@@ -669,7 +608,7 @@ int main(int ac, char * const *av)
 	bool listOnly = false;
 
 	int ch;
-	while ((ch = getopt(ac, av, "a:b:chlvL")) != -1)
+	while ((ch = getopt(ac, av, "a:b:cfhlvL")) != -1)
 		switch (ch)
 		{
 			case 'a':
@@ -700,6 +639,10 @@ int main(int ac, char * const *av)
 				ignoreCheckSum = true;
 				break;
 
+			case 'f':
+				force = true;
+				break;
+
 			case 'h':
 				goto usage;
 
@@ -732,11 +675,12 @@ int main(int ac, char * const *av)
 	if (!listOnly && ac != 1)
 	{
 usage:
-		cerr << "usage: " << execName << " [-chvL] [-b <bus-num> -a <dev-addr> ] { <file.hex> | -l }\n";
-		cerr << "<file.hex>\tFirmware image to use\n";
+		cerr << "usage: " << execName << " [-cfhvL] [-b <bus-num> -a <dev-addr> ] { <file.hex> | -l }\n";
+		cerr << "<file.hex>\tFirmware image to use, either Intel HEX or encoded .irrxfw\n";
 		cerr << "-l\t\tList devices and then exit\n";
 		cerr << "-v\t\tIncrease verbosity level\n";
 		cerr << "-c\t\tIgnore checksum errors in the firmware image file\n";
+		cerr << "-f\t\tUpload even if the image is known not to run on the keyboard\n";
 		cerr << "-b <bus-num>\tSpecify bus number device is attached to\n";
 		cerr << "-a <dev-addr>\tSpecify device address on bus\n";
 		cerr << "-L\t\tAssume the device is already in bootloader mode\n";
@@ -769,6 +713,15 @@ usage:
 		HexFile hexFile;
 		readHexFile(av[0], hexFile, ignoreCheckSum);
 
+		// Which keyboards an image runs on is only known for the images in Firmware::Known. No hashes are recorded there
+		// yet, so an unknown image is only warned about.
+		const Firmware::Entry *firmware = Firmware::Identify(hexFile);
+		if (firmware)
+			clog << "Image is " << firmware->Name << '\n';
+		else
+			cerr << "Warning: Unknown image, hash " << Format::Hex(Firmware::Hash(hexFile)) <<
+					", so the keyboards it runs on can't be checked\n";
+
 		if (!assumeLoader)
 		{
 			try
@@ -782,7 +735,20 @@ usage:
 				getDeviceDescriptor(*libusb_get_device(keyboardHandle.get()), desc);
 				clog << "  Device (firmware version): " << Format::Hex(desc.bcdDevice) << '\n';
 
-				// check firmware version
+				if (firmware && !firmware->RunsOn(desc.idProduct))
+				{
+					string error = string("Image ") + firmware->Name + " does not run on idProduct " +
+							Format::ToString(Format::Hex(desc.idProduct));
+					if (!force)
+						throw runtime_error(error + ", use -f to upload it anyway");
+
+					cerr << "Warning: " << error << '\n';
+				}
+
+				// Going back to an older version is expected, so a different one is only reported
+				if (firmware && desc.bcdDevice != firmware->BcdDevice)
+					clog << "  Replacing firmware version " << Format::Hex(desc.bcdDevice) << " with " <<
+							Format::Hex(firmware->BcdDevice) << '\n';
 
 				claimInterface(*keyboardHandle.get(), 0);
 				setBootMode(*keyboardHandle.get(), true, 0);
@@ -824,7 +790,7 @@ usage:
 
 		startUpdate(*loaderHandle.get());
 
-		writeOrVerify(*loaderHandle.get(), hexFile, false);
+		writeOrVerify(*loaderHandle.get(), hexFile, false, firmware ? firmware->LoaderEnd : HexFile::FlashEnd);
 
 		finishUpdate(*loaderHandle.get());
 